@@ -0,0 +1,198 @@
+#include "starlight.h"
+
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+
+/*
+ * batch decoding on a work stealing pool. every worker starts out with
+ * an even share of the images, as a range of indices it takes from the
+ * front. a worker that runs dry takes the back half of the range of the
+ * next one that still has images, so a few slow images do not leave the
+ * other threads idle. ranges only ever shrink, so once every one is
+ * empty the batch is through. each worker decodes with a scratch of its
+ * own, the buffers of one image are there for the next.
+ */
+typedef struct BatchWorker {
+    mtx_t lock; // over next and end
+    uint32_t next;
+    uint32_t end;
+    StarlightScratch scratch;
+    struct BatchPool *pool;
+} BatchWorker;
+
+typedef struct BatchPool {
+    StarlightBatch *batch;
+    BatchWorker *workers;
+    uint32_t worker_count;
+
+    // the outputs allocated here and not yet through done
+    mtx_t flight_lock;
+    cnd_t flight_done;
+    uint32_t flying;
+} BatchPool;
+
+static bool take_own(BatchWorker *worker, uint32_t *index) {
+    mtx_lock(&worker->lock);
+    bool taken = worker->next < worker->end;
+    if (taken) *index = worker->next++;
+    mtx_unlock(&worker->lock);
+    return taken;
+}
+
+static bool steal(BatchWorker *worker, uint32_t *index) {
+    BatchPool *pool = worker->pool;
+    uint32_t self = worker - pool->workers;
+
+    for (uint32_t i = 1; i < pool->worker_count; i++) {
+        BatchWorker *victim = &pool->workers[(self + i) % pool->worker_count];
+
+        mtx_lock(&victim->lock);
+        uint32_t left = victim->end - victim->next;
+        uint32_t start = victim->end - (left + 1) / 2;
+        uint32_t end = victim->end;
+        if (left) victim->end = start;
+        mtx_unlock(&victim->lock);
+
+        if (!left) continue;
+
+        // the first stolen image is decoded now, the rest are kept
+        mtx_lock(&worker->lock);
+        worker->next = start + 1;
+        worker->end = end;
+        mtx_unlock(&worker->lock);
+
+        *index = start;
+        return true;
+    }
+
+    return false;
+}
+
+static void begin_flight(BatchPool *pool) {
+    uint32_t limit = pool->batch->in_flight;
+
+    mtx_lock(&pool->flight_lock);
+    while (limit && pool->flying >= limit)
+        cnd_wait(&pool->flight_done, &pool->flight_lock);
+    pool->flying++;
+    mtx_unlock(&pool->flight_lock);
+}
+
+static void end_flight(BatchPool *pool) {
+    mtx_lock(&pool->flight_lock);
+    pool->flying--;
+    cnd_signal(&pool->flight_done);
+    mtx_unlock(&pool->flight_lock);
+}
+
+static void decode_image(BatchWorker *worker, uint32_t index) {
+    BatchPool *pool = worker->pool;
+    StarlightBatch *batch = pool->batch;
+    Starlight *image = &batch->images[index];
+
+    image->scratch = &worker->scratch;
+    starlight_status_t status = starlight_load(image);
+
+    // outputs made here only live until done is through with them
+    bool allocated = !status && image->out.s == NULL &&
+        image->rows == NULL && image->row == NULL;
+    bool flying = allocated && batch->done != NULL;
+
+    if (flying) begin_flight(pool);
+    if (allocated) {
+        image->out.s = malloc(image->out.l);
+        if (image->out.s == NULL) status = STARLIGHT_S_MALLOC_FAILED;
+    }
+
+    if (!status) status = image->loader(image);
+    batch->status[index] = status;
+
+    if (batch->done != NULL) batch->done(batch, index);
+
+    if (flying) {
+        free(image->out.s);
+        image->out.s = NULL;
+        end_flight(pool);
+    }
+
+    starlight_release(image);
+    image->scratch = NULL;
+}
+
+static int batch_worker(void *data) {
+    BatchWorker *worker = data;
+    uint32_t index = 0;
+
+    while (take_own(worker, &index) || steal(worker, &index))
+        decode_image(worker, index);
+
+    return 0;
+}
+
+starlight_status_t starlight_batch_decode(StarlightBatch *batch) {
+    if (batch->count == 0) return STARLIGHT_S_SUCCESS;
+    if (batch->images == NULL || batch->status == NULL)
+        return STARLIGHT_S_BUFFER_IS_NULL;
+
+    uint32_t threads = batch->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (threads > batch->count) threads = batch->count;
+
+    BatchPool pool = {
+        .batch = batch,
+        .workers = calloc(threads, sizeof(BatchWorker)),
+        .worker_count = threads,
+        .flying = 0,
+    };
+    thrd_t *threads_started = malloc(sizeof(thrd_t) * threads);
+
+    if (pool.workers == NULL || threads_started == NULL) {
+        free(pool.workers);
+        free(threads_started);
+        return STARLIGHT_S_MALLOC_FAILED;
+    }
+
+    mtx_init(&pool.flight_lock, mtx_plain);
+    cnd_init(&pool.flight_done);
+
+    for (uint32_t i = 0; i < threads; i++) {
+        BatchWorker *worker = &pool.workers[i];
+        mtx_init(&worker->lock, mtx_plain);
+        worker->next = (uint64_t)batch->count * i / threads;
+        worker->end = (uint64_t)batch->count * (i + 1) / threads;
+        worker->pool = &pool;
+    }
+
+    // the calling thread is worker 0. the images of a worker that could
+    // not be started are stolen by the others
+    uint32_t started = 0;
+    for (uint32_t i = 1; i < threads; i++) {
+        if (thrd_create(
+            &threads_started[started], batch_worker, &pool.workers[i]
+        )) continue;
+        started++;
+    }
+
+    batch_worker(&pool.workers[0]);
+    for (uint32_t i = 0; i < started; i++)
+        thrd_join(threads_started[i], NULL);
+
+    for (uint32_t i = 0; i < threads; i++) {
+        starlight_scratch_release(&pool.workers[i].scratch);
+        mtx_destroy(&pool.workers[i].lock);
+    }
+    mtx_destroy(&pool.flight_lock);
+    cnd_destroy(&pool.flight_done);
+    free(pool.workers);
+    free(threads_started);
+
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (batch->status[i]) return batch->status[i];
+    }
+
+    return STARLIGHT_S_SUCCESS;
+}
@@ -1,6 +1,14 @@
 
 #include "starlight.h"
 
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <threads.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 static const uint32_t CRC_TABLE[256] = {
     0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
     0xE963A535, 0x9E6495A3, 0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
@@ -47,13 +55,500 @@ static const uint32_t CRC_TABLE[256] = {
     0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
-uint32_t starlight_calc_crc(uint8_t *buffer, uint64_t length) {
-    printf("length: %ld\n", length);
+/*
+ * crc-32. the kernels work on the inverted running value, the public
+ * functions take and return the finished crc like zlib's crc32() does.
+ * slicing-by-8 is the portable path, on x86-64 with pclmul the bulk of
+ * the buffer is folded 64 bytes at a time with carry-less multiplies.
+ */
+static uint32_t CRC_SLICE[8][256];
+
+static void build_crc_slices(void) {
+    for (uint16_t n = 0; n < 256; n++) {
+        CRC_SLICE[0][n] = CRC_TABLE[n];
+    }
+
+    for (uint8_t k = 1; k < 8; k++) {
+        for (uint16_t n = 0; n < 256; n++) {
+            uint32_t crc = CRC_SLICE[k - 1][n];
+            CRC_SLICE[k][n] = (crc >> 8) ^ CRC_TABLE[crc & 0xff];
+        }
+    }
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *p, uint64_t length) {
+    for (; length >= 8; length -= 8, p += 8) {
+        uint32_t one = crc ^ (
+            p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)
+        );
+        uint32_t two = (
+            p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24)
+        );
+
+        crc = (
+            CRC_SLICE[7][one & 0xff] ^ CRC_SLICE[6][(one >> 8) & 0xff] ^
+            CRC_SLICE[5][(one >> 16) & 0xff] ^ CRC_SLICE[4][one >> 24] ^
+            CRC_SLICE[3][two & 0xff] ^ CRC_SLICE[2][(two >> 8) & 0xff] ^
+            CRC_SLICE[1][(two >> 16) & 0xff] ^ CRC_SLICE[0][two >> 24]
+        );
+    }
+
+    for (; length; length--) {
+        crc = (crc >> 8) ^ CRC_TABLE[*p++ ^ (crc & 0xff)];
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * folding constants for the bit-reflected crc-32 polynomial, from intel's
+ * "fast crc computation for generic polynomials using pclmulqdq".
+ * length must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc_fold(uint32_t crc, const uint8_t *p, uint64_t length) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    __m128i x5;
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+    p += 64;
+    length -= 64;
+
+    // fold four lanes in parallel
+    for (; length >= 64; length -= 64, p += 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+            _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+            _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+            _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+            _mm_loadu_si128((const __m128i *)(p + 0x30)));
+    }
+
+    // fold the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    for (; length >= 16; length -= 16, p += 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+            _mm_loadu_si128((const __m128i *)p));
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t *p, uint64_t length) {
+    if (length >= 64) {
+        uint64_t chunk = length & ~(uint64_t)15;
+        crc = crc_fold(crc, p, chunk);
+        p += chunk;
+        length -= chunk;
+    }
+
+    return crc_slice8(crc, p, length);
+}
+#endif
+
+
+/*
+ * adler-32. the sums are reduced modulo ADLER_BASE every ADLER_NMAX bytes,
+ * the largest run that can not overflow 32 bits.
+ * the vector kernels are picked once at runtime from the cpu features.
+ */
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+static uint32_t adler_scalar(
+    uint32_t adler, const uint8_t *p, uint64_t length
+) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+
+    while (length) {
+        uint32_t n = length < ADLER_NMAX ? length : ADLER_NMAX;
+        length -= n;
+
+        for (; n >= 8; n -= 8, p += 8) {
+            s1 += p[0]; s2 += s1;
+            s1 += p[1]; s2 += s1;
+            s1 += p[2]; s2 += s1;
+            s1 += p[3]; s2 += s1;
+            s1 += p[4]; s2 += s1;
+            s1 += p[5]; s2 += s1;
+            s1 += p[6]; s2 += s1;
+            s1 += p[7]; s2 += s1;
+        }
+        for (; n; n--) {
+            s1 += *p++; s2 += s1;
+        }
+
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+
+    return (s2 << 16) | s1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * 32 bytes per step: s1 gets the byte sums (psadbw), s2 gets the bytes
+ * weighted by their distance from the end of the step (pmaddubsw) plus
+ * 32 times every s1 seen before the step.
+ */
+__attribute__((target("ssse3")))
+static uint32_t adler_ssse3(uint32_t adler, const uint8_t *p, uint64_t length) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+
+    const __m128i tap1 = _mm_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17
+    );
+    const __m128i tap2 = _mm_setr_epi8(
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+    );
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    uint64_t blocks = length / 32;
+    length -= blocks * 32;
+
+    while (blocks) {
+        uint32_t n = blocks < ADLER_NMAX / 32 ? blocks : ADLER_NMAX / 32;
+        blocks -= n;
+
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, s1 * n);
+        __m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+        __m128i v_s1 = zero;
+
+        do {
+            __m128i bytes1 = _mm_loadu_si128((const __m128i *)p);
+            __m128i bytes2 = _mm_loadu_si128((const __m128i *)(p + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            __m128i mad1 = _mm_maddubs_epi16(bytes1, tap1);
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(mad1, ones));
+
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            __m128i mad2 = _mm_maddubs_epi16(bytes2, tap2);
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(mad2, ones));
+
+            p += 32;
+        } while (--n);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0xb1));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0x4e));
+        s1 += _mm_cvtsi128_si32(v_s1);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0xb1));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0x4e));
+        s2 = _mm_cvtsi128_si32(v_s2);
+
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+
+    return adler_scalar((s2 << 16) | s1, p, length);
+}
+
+__attribute__((target("avx2")))
+static uint32_t adler_avx2(uint32_t adler, const uint8_t *p, uint64_t length) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+
+    const __m256i tap = _mm256_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+    );
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    uint64_t blocks = length / 32;
+    length -= blocks * 32;
+
+    while (blocks) {
+        uint32_t n = blocks < ADLER_NMAX / 32 ? blocks : ADLER_NMAX / 32;
+        blocks -= n;
+
+        __m256i v_ps = _mm256_setr_epi32(s1 * n, 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_s2 = _mm256_setr_epi32(s2, 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_s1 = zero;
+
+        do {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            __m256i mad = _mm256_maddubs_epi16(bytes, tap);
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(mad, ones));
+
+            p += 32;
+        } while (--n);
+
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+        __m128i h1 = _mm_add_epi32(
+            _mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1)
+        );
+        h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, 0xb1));
+        h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, 0x4e));
+        s1 += _mm_cvtsi128_si32(h1);
+
+        __m128i h2 = _mm_add_epi32(
+            _mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1)
+        );
+        h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, 0xb1));
+        h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, 0x4e));
+        s2 = _mm_cvtsi128_si32(h2);
+
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+
+    return adler_scalar((s2 << 16) | s1, p, length);
+}
+#endif
+
+static uint32_t (*CRC_KERNEL)(uint32_t, const uint8_t *, uint64_t);
+static uint32_t (*ADLER_KERNEL)(uint32_t, const uint8_t *, uint64_t);
+static once_flag KERNELS_ONCE = ONCE_FLAG_INIT;
+
+static void pick_kernels(void) {
+    build_crc_slices();
+
+    CRC_KERNEL = crc_slice8;
+    ADLER_KERNEL = adler_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+#if defined(__x86_64__)
+    if (
+        __builtin_cpu_supports("sse4.2") &&
+        __builtin_cpu_supports("pclmul")
+    ) {
+        CRC_KERNEL = crc_pclmul;
+    }
+#endif
+
+    if (__builtin_cpu_supports("avx2")) {
+        ADLER_KERNEL = adler_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        ADLER_KERNEL = adler_ssse3;
+    }
+#endif
+}
+
+uint32_t starlight_update_crc(
+    uint32_t crc, const uint8_t *buffer, uint64_t length
+) {
+    call_once(&KERNELS_ONCE, pick_kernels);
+    return ~CRC_KERNEL(~crc, buffer, length);
+}
+
+uint32_t starlight_calc_crc(const uint8_t *buffer, uint64_t length) {
+    return starlight_update_crc(0, buffer, length);
+}
+
+uint32_t starlight_update_adler(
+    uint32_t adler, const uint8_t *buffer, uint64_t length
+) {
+    call_once(&KERNELS_ONCE, pick_kernels);
+    return ADLER_KERNEL(adler, buffer, length);
+}
+
+uint32_t starlight_calc_adler(const uint8_t *buffer, uint64_t length) {
+    return starlight_update_adler(1, buffer, length);
+}
+
+/*
+ * the adler-32 of two pieces put together, from their adler-32s and the
+ * length of the second: the first sum of the second piece starts out
+ * higher by the first's, which the second sum picks up once per byte.
+ */
+uint32_t starlight_combine_adler(
+    uint32_t adler1, uint32_t adler2, uint64_t length2
+) {
+    uint32_t remainder = (uint32_t)(length2 % ADLER_BASE);
+    uint32_t s1 = adler1 & 0xffff;
+    uint32_t s2 = (uint32_t)((uint64_t)remainder * s1 % ADLER_BASE);
+
+    uint32_t sum1 = s1 + (adler2 & 0xffff) + ADLER_BASE - 1;
+    uint32_t sum2 = (adler1 >> 16) + (adler2 >> 16) + s2 +
+        ADLER_BASE - remainder;
+
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum2 >= ADLER_BASE * 2) sum2 -= ADLER_BASE * 2;
+    if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+    return sum2 << 16 | sum1;
+}
+
+
+/*
+ * the deflate code tables, for inflate and deflate alike: the base value
+ * and extra bits of each length and distance code, the order the code
+ * length code lengths are stored in, and the code lengths of the fixed
+ * codes, with the two distance codes deflate leaves unused.
+ */
+const uint16_t STARLIGHT_LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+const uint8_t STARLIGHT_LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+const uint16_t STARLIGHT_DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+const uint8_t STARLIGHT_DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+const uint8_t STARLIGHT_CL_ORDER[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+const uint8_t STARLIGHT_FIXED_LITLEN_LENGTHS[288] = {
+    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+    9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+    9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+    9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+
+const uint8_t STARLIGHT_FIXED_DIST_LENGTHS[32] = {
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+};
+
+uint16_t starlight_reverse_bits(uint16_t code, uint8_t length) {
+    uint16_t reversed = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    return reversed;
+}
+
+
+/*
+ * parallel jobs: the workers and the calling thread take the next job
+ * index from a shared counter until none are left, or one has failed.
+ */
+typedef struct Parallel {
+    StarlightJob job;
+    void *user;
+    uint32_t count;
+    atomic_uint next;
+    atomic_int status;
+} Parallel;
+
+static int parallel_worker(void *data) {
+    Parallel *parallel = data;
+
+    while (atomic_load(&parallel->status) == STARLIGHT_S_SUCCESS) {
+        uint32_t index = atomic_fetch_add(&parallel->next, 1);
+        if (index >= parallel->count) break;
+
+        starlight_status_t status = parallel->job(parallel->user, index);
+        if (status == STARLIGHT_S_SUCCESS) continue;
 
-    uint32_t crc = ~0u;
-    for (uint32_t i = 0; i < length; i++) {
-        crc = (crc >> 8) ^ CRC_TABLE[buffer[i] ^ (crc & 0xff)];
+        int expected = STARLIGHT_S_SUCCESS;
+        atomic_compare_exchange_strong(&parallel->status, &expected, status);
     }
-    return ~crc;
+
+    return 0;
 }
 
+starlight_status_t starlight_parallel(
+    uint32_t threads, uint32_t count, StarlightJob job, void *user
+) {
+    Parallel parallel = { .job = job, .user = user, .count = count };
+    atomic_init(&parallel.next, 0);
+    atomic_init(&parallel.status, STARLIGHT_S_SUCCESS);
+
+    if (threads > count) threads = count;
+
+    // fewer workers than asked for when threads can not be made, the
+    // calling thread alone at worst
+    thrd_t *workers = NULL;
+    uint32_t started = 0;
+    if (threads > 1) workers = malloc(sizeof(thrd_t) * (threads - 1));
+
+    while (workers != NULL && started < threads - 1) {
+        if (thrd_create(&workers[started], parallel_worker, &parallel))
+            break;
+        started++;
+    }
+
+    parallel_worker(&parallel);
+
+    for (uint32_t i = 0; i < started; i++) thrd_join(workers[i], NULL);
+    free(workers);
+    return atomic_load(&parallel.status);
+}
@@ -0,0 +1,922 @@
+#include "starlight.h"
+
+#include <stdlib.h>
+#include <threads.h>
+
+/*
+ * deflate compression into a zlib stream. the matches and literals are
+ * collected in blocks of up to BLOCK_TOKENS, and every block is written
+ * with whichever of its own huffman codes, the fixed codes or a stored
+ * copy comes out the smallest, so the stream never grows past
+ * starlight_deflate_bound.
+ *
+ * STARLIGHT_L_FASTEST keeps only the last position each 4 byte prefix
+ * was seen at and takes the match found there as it is, hashing just
+ * the first and last position of every match. the balanced level
+ * follows a chain of earlier positions through the window, and puts a
+ * match off by a byte when the next one turns out longer.
+ */
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 4 // the hash covers 4 bytes, deflate allows 3
+#define MAX_MATCH 258
+#define HASH_BITS 15
+#define BLOCK_TOKENS (1 << 15)
+#define MAX_STORED 65535
+
+// each call covers at most this much input, positions fit 32 bits
+#define MAX_SPAN (1u << 30)
+
+#define LITLEN_CODES 286
+#define DIST_CODES 30
+#define CL_CODES 19
+#define MAX_CODE_LENGTH 15
+#define MAX_CL_LENGTH 7
+
+typedef struct LevelSettings {
+    uint32_t chain; // candidates tried per position
+    uint32_t nice; // a match this long ends the search
+    bool lazy;
+} LevelSettings;
+
+static const LevelSettings LEVEL[STARLIGHT_L_LENGTH] = {
+    [STARLIGHT_L_BALANCED] = { .chain = 24, .nice = 128, .lazy = true },
+    [STARLIGHT_L_FASTEST] = { .chain = 1, .nice = MAX_MATCH, .lazy = false },
+};
+
+// extra bits after the repeat codes
+static const uint8_t CL_EXTRA[CL_CODES] = { [16] = 2, 3, 7 };
+
+// length - 3 to its code, distance - 1 to its code (see dist_code)
+static uint8_t LENGTH_CODE[256];
+static uint8_t DIST_CODE[512];
+static once_flag CODE_TABLES_ONCE = ONCE_FLAG_INIT;
+
+static void build_code_tables(void) {
+    for (uint8_t code = 0; code < 29; code++) {
+        uint32_t end = code == 28 ? 256 : STARLIGHT_LENGTH_BASE[code + 1] - 3;
+        for (uint32_t i = STARLIGHT_LENGTH_BASE[code] - 3; i < end; i++)
+            LENGTH_CODE[i] = code;
+    }
+
+    // below 256 by the distance itself, above by the distance / 128
+    for (uint8_t code = 0; code < DIST_CODES; code++) {
+        uint32_t end = code == 29 ? 32768 : STARLIGHT_DIST_BASE[code + 1] - 1u;
+        for (uint32_t d = STARLIGHT_DIST_BASE[code] - 1u; d < end; d++) {
+            if (d < 256) DIST_CODE[d] = code;
+            else DIST_CODE[256 + (d >> 7)] = code;
+        }
+    }
+}
+
+static inline uint8_t dist_code(uint32_t dist) {
+    uint32_t d = dist - 1;
+    return d < 256 ? DIST_CODE[d] : DIST_CODE[256 + (d >> 7)];
+}
+
+
+/*
+ * bit writer: bits go in at the top of a 64 bit accumulator and leave
+ * it 32 at a time, least significant first as deflate wants them. a
+ * write past the end of the output sets `overflow` and is dropped.
+ */
+typedef struct BitWriter {
+    uint64_t bits;
+    uint32_t count;
+    uint8_t *c;
+    uint8_t *e;
+    bool overflow;
+} BitWriter;
+
+static inline void put_bits(BitWriter *w, uint64_t value, uint32_t n) {
+    w->bits |= value << w->count;
+    w->count += n;
+
+    if (w->count < 32) return;
+
+    if (w->e - w->c >= 4) {
+        uint32_t word = (uint32_t)w->bits;
+        uint8_t bytes[4] = {
+            (uint8_t)word, (uint8_t)(word >> 8),
+            (uint8_t)(word >> 16), (uint8_t)(word >> 24),
+        };
+        memcpy(w->c, bytes, 4);
+        w->c += 4;
+    } else {
+        w->overflow = true;
+    }
+    w->bits >>= 32;
+    w->count -= 32;
+}
+
+// pad to a byte boundary and write out every whole byte held
+static void align_bits(BitWriter *w) {
+    w->count = (w->count + 7) & ~7u;
+
+    for (; w->count; w->count -= 8, w->bits >>= 8) {
+        if (w->c == w->e) {
+            w->overflow = true;
+            continue;
+        }
+        *w->c++ = (uint8_t)w->bits;
+    }
+    w->bits = 0;
+}
+
+
+/*
+ * code lengths for the symbol frequencies, at most `limit` bits long.
+ * the lengths come from moffat and katajainen's in place huffman on the
+ * symbols sorted by frequency, the ones past the limit are then folded
+ * back in, taking codes from the shorter lengths the way miniz does.
+ */
+typedef struct SymbolFrequency {
+    uint32_t frequency;
+    uint16_t symbol;
+} SymbolFrequency;
+
+static int compare_frequency(const void *a, const void *b) {
+    const SymbolFrequency *x = a;
+    const SymbolFrequency *y = b;
+    if (x->frequency != y->frequency)
+        return x->frequency < y->frequency ? -1 : 1;
+    return x->symbol < y->symbol ? -1 : 1;
+}
+
+static void build_lengths(
+    const uint32_t *frequency, uint32_t count, uint8_t limit,
+    uint8_t *lengths
+) {
+    SymbolFrequency sorted[LITLEN_CODES];
+    uint32_t depth[LITLEN_CODES];
+    uint32_t used = 0;
+
+    memset(lengths, 0, count);
+    for (uint16_t i = 0; i < count; i++) {
+        if (frequency[i]) sorted[used++] = (SymbolFrequency) {
+            .frequency = frequency[i], .symbol = i
+        };
+    }
+
+    // two codes at the least: a lone code is not a complete prefix code
+    for (uint16_t i = 0; used < 2; i++) {
+        if (!frequency[i]) sorted[used++] = (SymbolFrequency) {
+            .frequency = 1, .symbol = i
+        };
+    }
+
+    qsort(sorted, used, sizeof(SymbolFrequency), compare_frequency);
+    for (uint32_t i = 0; i < used; i++) depth[i] = sorted[i].frequency;
+
+    // parents, left to right
+    uint32_t root = 0;
+    uint32_t leaf = 2;
+    depth[0] += depth[1];
+    for (uint32_t next = 1; next < used - 1; next++) {
+        if (leaf >= used || depth[root] < depth[leaf]) {
+            depth[next] = depth[root];
+            depth[root++] = next;
+        } else {
+            depth[next] = depth[leaf++];
+        }
+
+        if (leaf >= used || (root < next && depth[root] < depth[leaf])) {
+            depth[next] += depth[root];
+            depth[root++] = next;
+        } else {
+            depth[next] += depth[leaf++];
+        }
+    }
+
+    // internal node depths, right to left
+    depth[used - 2] = 0;
+    for (int32_t next = used - 3; next >= 0; next--)
+        depth[next] = depth[depth[next]] + 1;
+
+    // leaf depths, right to left
+    uint32_t lengths_count[64] = { 0 };
+    int32_t available = 1;
+    int32_t internal = used - 2;
+    uint32_t level = 0;
+    while (available > 0) {
+        uint32_t nodes = 0;
+        for (; internal >= 0 && depth[internal] == level; internal--)
+            nodes++;
+        for (; available > (int32_t)nodes; available--)
+            lengths_count[level < 63 ? level : 63]++;
+        available = 2 * nodes;
+        level++;
+    }
+
+    // fold the codes past the limit back in, keeping the kraft sum
+    for (uint32_t i = limit + 1; i < 64; i++) {
+        lengths_count[limit] += lengths_count[i];
+        lengths_count[i] = 0;
+    }
+
+    uint32_t total = 0;
+    for (uint32_t i = limit; i > 0; i--)
+        total += lengths_count[i] << (limit - i);
+
+    while (total != (1u << limit)) {
+        lengths_count[limit]--;
+        for (uint32_t i = limit - 1; i > 0; i--) {
+            if (lengths_count[i]) {
+                lengths_count[i]--;
+                lengths_count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // the rarest symbols get the longest codes
+    uint32_t at = 0;
+    for (uint32_t length = limit; length > 0; length--) {
+        for (uint32_t n = lengths_count[length]; n; n--)
+            lengths[sorted[at++].symbol] = length;
+    }
+}
+
+// canonical codes for the lengths, bit reversed for the writer
+static void build_codes(
+    const uint8_t *lengths, uint32_t count, uint16_t *codes
+) {
+    uint16_t length_count[MAX_CODE_LENGTH + 1] = { 0 };
+    uint16_t next[MAX_CODE_LENGTH + 1] = { 0 };
+
+    for (uint32_t i = 0; i < count; i++) length_count[lengths[i]]++;
+    length_count[0] = 0;
+
+    uint16_t code = 0;
+    for (uint8_t bits = 1; bits <= MAX_CODE_LENGTH; bits++) {
+        code = (code + length_count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (lengths[i])
+            codes[i] = starlight_reverse_bits(next[lengths[i]]++, lengths[i]);
+    }
+}
+
+
+/*
+ * a token is a literal byte below 256, or a match as
+ * distance << 8 | (length - 3)
+ */
+typedef struct Deflater {
+    LevelSettings settings;
+    BitWriter out;
+
+    const uint8_t *data; // positions are offsets from here
+    uint64_t emitted; // the input covered by the tokens so far
+    uint64_t block_start;
+
+    uint32_t *head; // last position + 1 of each hash, 0 for none
+    uint32_t *chain; // the position + 1 before, by position % window
+
+    uint32_t *tokens;
+    uint32_t token_count;
+    uint32_t litlen_frequency[LITLEN_CODES];
+    uint32_t dist_frequency[DIST_CODES];
+} Deflater;
+
+static inline uint32_t load_u32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static inline uint32_t hash4(const uint8_t *p) {
+    return (load_u32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline uint32_t match_length(
+    const uint8_t *a, const uint8_t *b, uint32_t limit
+) {
+    uint32_t length = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; length + 8 <= limit; length += 8) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y) return length + (__builtin_ctzll(x ^ y) >> 3);
+    }
+#endif
+
+    for (; length < limit && a[length] == b[length]; length++);
+    return length;
+}
+
+
+static void write_block(Deflater *z, bool final);
+
+static inline void add_literal(Deflater *z) {
+    uint8_t literal = z->data[z->emitted++];
+    z->tokens[z->token_count++] = literal;
+    z->litlen_frequency[literal]++;
+
+    if (z->token_count == BLOCK_TOKENS) write_block(z, false);
+}
+
+static inline void add_match(Deflater *z, uint32_t length, uint32_t dist) {
+    z->emitted += length;
+    z->tokens[z->token_count++] = (dist << 8) | (length - 3);
+    z->litlen_frequency[257 + LENGTH_CODE[length - 3]]++;
+    z->dist_frequency[dist_code(dist)]++;
+
+    if (z->token_count == BLOCK_TOKENS) write_block(z, false);
+}
+
+// record `pos` under its hash, and hand back the position seen before
+static inline uint32_t insert(Deflater *z, uint64_t pos) {
+    uint32_t hash = hash4(z->data + pos);
+    uint32_t previous = z->head[hash];
+    z->head[hash] = (uint32_t)pos + 1;
+    if (z->chain != NULL) z->chain[pos % WINDOW_SIZE] = previous;
+    return previous;
+}
+
+// the longest match for `pos` in the window, 0 when under MIN_MATCH
+static inline uint32_t find_match(
+    Deflater *z, uint64_t pos, uint64_t end, uint32_t *dist
+) {
+    uint64_t left = end - pos;
+    if (left < MIN_MATCH) return 0;
+
+    uint32_t limit = left < MAX_MATCH ? (uint32_t)left : MAX_MATCH;
+    uint32_t candidate = insert(z, pos);
+    uint32_t best = MIN_MATCH - 1;
+    const uint8_t *current = z->data + pos;
+
+    for (uint32_t tries = z->settings.chain; candidate && tries; tries--) {
+        uint64_t at = candidate - 1;
+        if (pos - at > WINDOW_SIZE) break;
+
+        // a longer match has to get past the end of the best one
+        const uint8_t *earlier = z->data + at;
+        if (earlier[best] == current[best]) {
+            uint32_t length = match_length(earlier, current, limit);
+            if (length > best) {
+                best = length;
+                *dist = (uint32_t)(pos - at);
+                if (length >= z->settings.nice || length == limit) break;
+            }
+        }
+
+        if (z->chain == NULL) break;
+
+        // the chain slot may have moved on to a later position
+        uint32_t next = z->chain[at % WINDOW_SIZE];
+        if (next == 0 || next - 1 >= at) break;
+        candidate = next;
+    }
+
+    return best >= MIN_MATCH ? best : 0;
+}
+
+// hash the bytes a match covered, so later matches can start in them
+static inline void insert_range(
+    Deflater *z, uint64_t from, uint64_t to, uint64_t end
+) {
+    if (end < MIN_MATCH) return;
+    if (to > end - MIN_MATCH + 1) to = end - MIN_MATCH + 1;
+    for (uint64_t pos = from; pos < to; pos++) insert(z, pos);
+}
+
+static void compress_fastest(Deflater *z, uint64_t end) {
+    while (z->emitted < end) {
+        uint32_t dist = 0;
+        uint32_t length = find_match(z, z->emitted, end, &dist);
+
+        if (length == 0) {
+            add_literal(z);
+            continue;
+        }
+
+        // only the last position of the match is hashed, enough to keep
+        // the table from going stale over long runs of matches
+        add_match(z, length, dist);
+        insert_range(z, z->emitted - 1, z->emitted, end);
+    }
+}
+
+static void compress_lazy(Deflater *z, uint64_t end) {
+    uint64_t pos = z->emitted;
+    uint32_t length = 0;
+    uint32_t dist = 0;
+
+    if (pos < end) length = find_match(z, pos, end, &dist);
+
+    while (pos < end) {
+        if (length == 0 || length >= z->settings.nice) {
+            if (length) {
+                add_match(z, length, dist);
+                insert_range(z, pos + 1, pos + length, end);
+                pos += length;
+            } else {
+                add_literal(z);
+                pos++;
+            }
+
+            length = pos < end ? find_match(z, pos, end, &dist) : 0;
+            continue;
+        }
+
+        // a longer match a byte later wins over this one
+        uint32_t next_dist = 0;
+        uint32_t next = pos + 1 < end ?
+            find_match(z, pos + 1, end, &next_dist) : 0;
+
+        if (next > length) {
+            add_literal(z);
+            pos++;
+            length = next;
+            dist = next_dist;
+            continue;
+        }
+
+        add_match(z, length, dist);
+        insert_range(z, pos + 2, pos + length, end);
+        pos += length;
+        length = pos < end ? find_match(z, pos, end, &dist) : 0;
+    }
+}
+
+
+static void write_tokens(
+    Deflater *z, const uint16_t *litlen_codes, const uint8_t *litlen_lengths,
+    const uint16_t *dist_codes, const uint8_t *dist_lengths
+) {
+    BitWriter *w = &z->out;
+
+    for (uint32_t i = 0; i < z->token_count; i++) {
+        uint32_t token = z->tokens[i];
+
+        if (token < 256) {
+            put_bits(w, litlen_codes[token], litlen_lengths[token]);
+            continue;
+        }
+
+        uint32_t length = token & 0xff;
+        uint32_t dist = token >> 8;
+
+        uint8_t code = LENGTH_CODE[length];
+        put_bits(
+            w,
+            litlen_codes[257 + code] |
+            (length + 3 - STARLIGHT_LENGTH_BASE[code]) <<
+            litlen_lengths[257 + code],
+            litlen_lengths[257 + code] + STARLIGHT_LENGTH_EXTRA[code]
+        );
+
+        code = dist_code(dist);
+        put_bits(
+            w,
+            dist_codes[code] |
+            (uint64_t)(dist - STARLIGHT_DIST_BASE[code]) << dist_lengths[code],
+            dist_lengths[code] + STARLIGHT_DIST_EXTRA[code]
+        );
+    }
+
+    put_bits(w, litlen_codes[256], litlen_lengths[256]);
+}
+
+// bits the tokens take with the given code lengths, extra bits included
+static uint64_t tokens_cost(
+    Deflater *z, const uint8_t *litlen_lengths, const uint8_t *dist_lengths
+) {
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < LITLEN_CODES; i++) {
+        uint8_t extra = i > 256 ? STARLIGHT_LENGTH_EXTRA[i - 257] : 0;
+        bits += (uint64_t)z->litlen_frequency[i] * (litlen_lengths[i] + extra);
+    }
+    for (uint32_t i = 0; i < DIST_CODES; i++) {
+        bits += (uint64_t)z->dist_frequency[i] *
+            (dist_lengths[i] + STARLIGHT_DIST_EXTRA[i]);
+    }
+    return bits;
+}
+
+/*
+ * the code lengths of a dynamic block, run length coded with the code
+ * length alphabet: 16 repeats the last length 3 to 6 times, 17 and 18
+ * stand for 3 to 10 and 11 to 138 zeros. symbols hold the extra bits
+ * above bit 5.
+ */
+static uint32_t encode_lengths(
+    const uint8_t *lengths, uint32_t count, uint16_t *symbols,
+    uint32_t *frequency
+) {
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < count;) {
+        uint8_t length = lengths[i];
+        uint32_t run = 1;
+        while (i + run < count && lengths[i + run] == length) run++;
+        i += run;
+
+        if (length == 0) {
+            while (run >= 11) {
+                uint32_t take = run < 138 ? run : 138;
+                symbols[n++] = 18 | (take - 11) << 5;
+                frequency[18]++;
+                run -= take;
+            }
+            if (run >= 3) {
+                symbols[n++] = 17 | (run - 3) << 5;
+                frequency[17]++;
+                run = 0;
+            }
+        } else {
+            symbols[n++] = length;
+            frequency[length]++;
+            run--;
+
+            while (run >= 3) {
+                uint32_t take = run < 6 ? run : 6;
+                symbols[n++] = 16 | (take - 3) << 5;
+                frequency[16]++;
+                run -= take;
+            }
+        }
+
+        for (; run; run--) {
+            symbols[n++] = length;
+            frequency[length]++;
+        }
+    }
+
+    return n;
+}
+
+static void write_stored(Deflater *z, bool final) {
+    BitWriter *w = &z->out;
+    uint64_t start = z->block_start;
+    uint64_t left = z->emitted - start;
+
+    do {
+        uint32_t length = left < MAX_STORED ? (uint32_t)left : MAX_STORED;
+        bool last = final && length == left;
+
+        put_bits(w, last, 3);
+        align_bits(w);
+
+        if (w->e - w->c < 4 + length) {
+            w->overflow = true;
+            return;
+        }
+
+        uint8_t header[4] = {
+            (uint8_t)length, (uint8_t)(length >> 8),
+            (uint8_t)~length, (uint8_t)(~length >> 8),
+        };
+        memcpy(w->c, header, 4);
+        memcpy(w->c + 4, z->data + start, length);
+        w->c += 4 + length;
+
+        start += length;
+        left -= length;
+    } while (left);
+}
+
+static void write_block(Deflater *z, bool final) {
+    BitWriter *w = &z->out;
+
+    z->litlen_frequency[256] = 1;
+
+    uint8_t litlen_lengths[LITLEN_CODES];
+    uint8_t dist_lengths[DIST_CODES];
+    build_lengths(
+        z->litlen_frequency, LITLEN_CODES, MAX_CODE_LENGTH, litlen_lengths
+    );
+    build_lengths(z->dist_frequency, DIST_CODES, MAX_CODE_LENGTH, dist_lengths);
+
+    uint32_t hlit = LITLEN_CODES;
+    while (hlit > 257 && !litlen_lengths[hlit - 1]) hlit--;
+    uint32_t hdist = DIST_CODES;
+    while (hdist > 1 && !dist_lengths[hdist - 1]) hdist--;
+
+    // both length lists are coded as one, runs may cross between them
+    uint8_t lengths[LITLEN_CODES + DIST_CODES];
+    memcpy(lengths, litlen_lengths, hlit);
+    memcpy(lengths + hlit, dist_lengths, hdist);
+
+    uint16_t cl_symbols[LITLEN_CODES + DIST_CODES];
+    uint32_t cl_frequency[CL_CODES] = { 0 };
+    uint32_t cl_count = encode_lengths(
+        lengths, hlit + hdist, cl_symbols, cl_frequency
+    );
+
+    uint8_t cl_lengths[CL_CODES];
+    build_lengths(cl_frequency, CL_CODES, MAX_CL_LENGTH, cl_lengths);
+
+    uint32_t hclen = CL_CODES;
+    while (hclen > 4 && !cl_lengths[STARLIGHT_CL_ORDER[hclen - 1]]) hclen--;
+
+    uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen +
+        tokens_cost(z, litlen_lengths, dist_lengths);
+    for (uint32_t i = 0; i < CL_CODES; i++) {
+        dynamic_bits += (uint64_t)cl_frequency[i] *
+            (cl_lengths[i] + CL_EXTRA[i]);
+    }
+
+    uint64_t fixed_bits = 3 +
+        tokens_cost(
+            z, STARLIGHT_FIXED_LITLEN_LENGTHS, STARLIGHT_FIXED_DIST_LENGTHS
+        );
+
+    uint64_t stored_length = z->emitted - z->block_start;
+    uint64_t stored_bits = 8 * (
+        stored_length + 5 * (stored_length / MAX_STORED + 1)
+    ) + 7;
+
+    if (stored_bits <= dynamic_bits && stored_bits <= fixed_bits) {
+        write_stored(z, final);
+    } else if (fixed_bits <= dynamic_bits) {
+        uint16_t litlen_codes[288];
+        uint16_t dist_codes[DIST_CODES];
+        build_codes(STARLIGHT_FIXED_LITLEN_LENGTHS, 288, litlen_codes);
+        build_codes(STARLIGHT_FIXED_DIST_LENGTHS, DIST_CODES, dist_codes);
+
+        put_bits(w, final | 1 << 1, 3);
+        write_tokens(
+            z, litlen_codes, STARLIGHT_FIXED_LITLEN_LENGTHS,
+            dist_codes, STARLIGHT_FIXED_DIST_LENGTHS
+        );
+    } else {
+        uint16_t litlen_codes[LITLEN_CODES];
+        uint16_t dist_codes[DIST_CODES];
+        uint16_t cl_codes[CL_CODES];
+        build_codes(litlen_lengths, LITLEN_CODES, litlen_codes);
+        build_codes(dist_lengths, DIST_CODES, dist_codes);
+        build_codes(cl_lengths, CL_CODES, cl_codes);
+
+        put_bits(w, final | 2 << 1, 3);
+        put_bits(w, hlit - 257, 5);
+        put_bits(w, hdist - 1, 5);
+        put_bits(w, hclen - 4, 4);
+        for (uint32_t i = 0; i < hclen; i++)
+            put_bits(w, cl_lengths[STARLIGHT_CL_ORDER[i]], 3);
+
+        for (uint32_t i = 0; i < cl_count; i++) {
+            uint16_t symbol = cl_symbols[i] & 31;
+            put_bits(w, cl_codes[symbol], cl_lengths[symbol]);
+            put_bits(w, cl_symbols[i] >> 5, CL_EXTRA[symbol]);
+        }
+
+        write_tokens(z, litlen_codes, litlen_lengths, dist_codes, dist_lengths);
+    }
+
+    z->block_start = z->emitted;
+    z->token_count = 0;
+    memset(z->litlen_frequency, 0, sizeof(z->litlen_frequency));
+    memset(z->dist_frequency, 0, sizeof(z->dist_frequency));
+}
+
+
+static starlight_status_t begin_deflater(
+    Deflater *z, StarlightBuffer *output, starlight_level_t level
+) {
+    call_once(&CODE_TABLES_ONCE, build_code_tables);
+
+    memset(z, 0, sizeof(Deflater));
+    z->settings = LEVEL[level];
+    z->out = (BitWriter) {
+        .c = output->c, .e = output->e, .bits = 0, .count = 0,
+        .overflow = false,
+    };
+
+    z->head = malloc(sizeof(uint32_t) << HASH_BITS);
+    z->tokens = malloc(sizeof(uint32_t) * BLOCK_TOKENS);
+    if (z->settings.chain > 1)
+        z->chain = malloc(sizeof(uint32_t) * WINDOW_SIZE);
+
+    if (
+        z->head == NULL || z->tokens == NULL ||
+        (z->settings.chain > 1 && z->chain == NULL)
+    ) return STARLIGHT_S_MALLOC_FAILED;
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+static void release_deflater(Deflater *z) {
+    free(z->head);
+    free(z->chain);
+    free(z->tokens);
+}
+
+/*
+ * compress data[start, end) as raw deflate blocks. the window reaches
+ * back into data[start - 32 KiB, start), which is only looked up.
+ */
+static void deflate_span(
+    Deflater *z, const uint8_t *data, uint64_t start, uint64_t end,
+    bool final
+) {
+    uint64_t primed = start < WINDOW_SIZE ? start : WINDOW_SIZE;
+
+    z->data = data + start - primed;
+    z->emitted = primed;
+    z->block_start = primed;
+    memset(z->head, 0, sizeof(uint32_t) << HASH_BITS);
+
+    insert_range(z, 0, primed, end - start + primed);
+
+    if (z->settings.lazy) compress_lazy(z, end - start + primed);
+    else compress_fastest(z, end - start + primed);
+
+    if (z->token_count || final) write_block(z, final);
+}
+
+uint64_t starlight_deflate_bound(uint64_t length) {
+    // stored blocks at worst, the zlib header, adler-32 and an empty
+    // final block, the bit writer writes 4 bytes at a time
+    return length + 5 * (length / MAX_STORED + length / 16384 + 2) + 16;
+}
+
+// the zlib header: a 32 KiB window, the level hint and a check value
+static starlight_status_t begin_zlib(
+    StarlightBuffer *output, starlight_level_t level
+) {
+    output->c = output->s;
+    output->e = output->s + output->l;
+    if (output->l < 6) return STARLIGHT_S_OUTPUT_TOO_SMALL;
+
+    uint8_t cmf = 0x78;
+    uint8_t flg = (level == STARLIGHT_L_FASTEST ? 0 : 2) << 6;
+    flg |= 31 - (cmf * 256 + flg) % 31;
+    *output->c++ = cmf;
+    *output->c++ = flg;
+    return STARLIGHT_S_SUCCESS;
+}
+
+static starlight_status_t end_zlib(StarlightBuffer *output, uint32_t adler) {
+    if (output->e - output->c < 4) return STARLIGHT_S_OUTPUT_TOO_SMALL;
+
+    *output->c++ = (uint8_t)(adler >> 24);
+    *output->c++ = (uint8_t)(adler >> 16);
+    *output->c++ = (uint8_t)(adler >> 8);
+    *output->c++ = (uint8_t)adler;
+    return STARLIGHT_S_SUCCESS;
+}
+
+starlight_status_t starlight_deflate(
+    StarlightBuffer *input, StarlightBuffer *output, starlight_level_t level
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    if (input->s == NULL && input->l) return STARLIGHT_S_BUFFER_IS_NULL;
+    if (output->s == NULL) return STARLIGHT_S_BUFFER_IS_NULL;
+    if (level >= STARLIGHT_L_LENGTH) return STARLIGHT_S_NOT_IMPLEMENTED;
+
+    if ((status = begin_zlib(output, level))) return status;
+
+    Deflater z;
+    if ((status = begin_deflater(&z, output, level))) {
+        release_deflater(&z);
+        return status;
+    }
+
+    static const uint8_t EMPTY[1] = { 0 };
+    const uint8_t *data = input->l ? input->s : EMPTY;
+
+    uint64_t start = 0;
+    do {
+        uint64_t end = input->l - start > MAX_SPAN ?
+            start + MAX_SPAN : input->l;
+        deflate_span(&z, data, start, end, end == input->l);
+        start = end;
+    } while (start < input->l);
+
+    align_bits(&z.out);
+    bool overflow = z.out.overflow;
+    output->c = z.out.c;
+    release_deflater(&z);
+
+    if (overflow) return STARLIGHT_S_OUTPUT_TOO_SMALL;
+    return end_zlib(output, starlight_calc_adler(data, input->l));
+}
+
+
+/*
+ * banded deflate: every band is compressed into a buffer of its own,
+ * the last one ends the stream and the others end in a sync flush, an
+ * empty stored block that leaves them on a byte boundary, so the bands
+ * are simply put one after the other. the adler-32 of each band is
+ * worked out with it and combined at the end.
+ */
+#define MIN_BAND (1u << 16) // keeps the flushes within the deflate bound
+
+typedef struct DeflateBand {
+    StarlightBuffer out;
+    uint32_t adler;
+} DeflateBand;
+
+typedef struct DeflateBands {
+    const uint8_t *data;
+    uint64_t length;
+    uint64_t band;
+    starlight_level_t level;
+    bool prime;
+    DeflateBand *bands;
+} DeflateBands;
+
+static starlight_status_t deflate_band(void *user, uint32_t index) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    DeflateBands *bands = user;
+    DeflateBand *band = &bands->bands[index];
+
+    uint64_t start = (uint64_t)index * bands->band;
+    uint64_t end = bands->length - start > bands->band ?
+        start + bands->band : bands->length;
+    bool final = end == bands->length;
+
+    band->out.l = starlight_deflate_bound(end - start);
+    band->out.s = malloc(band->out.l);
+    if (band->out.s == NULL) return STARLIGHT_S_MALLOC_FAILED;
+    band->out.c = band->out.s;
+    band->out.e = band->out.s + band->out.l;
+
+    Deflater z;
+    if ((status = begin_deflater(&z, &band->out, bands->level))) {
+        release_deflater(&z);
+        return status;
+    }
+
+    // without priming the window starts out empty at the band
+    if (bands->prime) deflate_span(&z, bands->data, start, end, final);
+    else deflate_span(&z, bands->data + start, 0, end - start, final);
+
+    if (!final) {
+        put_bits(&z.out, 0, 3);
+        align_bits(&z.out);
+        put_bits(&z.out, 0xffff0000u, 32);
+    }
+
+    align_bits(&z.out);
+    bool overflow = z.out.overflow;
+    band->out.c = z.out.c;
+    release_deflater(&z);
+
+    if (overflow) return STARLIGHT_S_OUTPUT_TOO_SMALL;
+
+    band->adler = starlight_calc_adler(bands->data + start, end - start);
+    return STARLIGHT_S_SUCCESS;
+}
+
+starlight_status_t starlight_deflate_bands(
+    StarlightBuffer *input, StarlightBuffer *output, starlight_level_t level,
+    uint32_t threads, uint64_t band, bool prime
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    if (input->s == NULL && input->l) return STARLIGHT_S_BUFFER_IS_NULL;
+    if (output->s == NULL) return STARLIGHT_S_BUFFER_IS_NULL;
+    if (level >= STARLIGHT_L_LENGTH) return STARLIGHT_S_NOT_IMPLEMENTED;
+
+    if (band == 0) band = input->l / ((uint64_t)threads * 4 + 1) + 1;
+    if (band < MIN_BAND) band = MIN_BAND;
+    if (band > MAX_SPAN) band = MAX_SPAN;
+
+    uint64_t count = (input->l + band - 1) / band;
+    if (threads <= 1 || count <= 1 || count > UINT32_MAX)
+        return starlight_deflate(input, output, level);
+
+    DeflateBands bands = {
+        .data = input->s, .length = input->l, .band = band,
+        .level = level, .prime = prime,
+        .bands = calloc(count, sizeof(DeflateBand)),
+    };
+    if (bands.bands == NULL) return STARLIGHT_S_MALLOC_FAILED;
+
+    status = starlight_parallel(threads, count, deflate_band, &bands);
+    if (!status) status = begin_zlib(output, level);
+
+    uint32_t adler = 1;
+    for (uint64_t i = 0; i < count && !status; i++) {
+        StarlightBuffer *out = &bands.bands[i].out;
+        uint64_t length = out->c - out->s;
+
+        if ((uint64_t)(output->e - output->c) < length) {
+            status = STARLIGHT_S_OUTPUT_TOO_SMALL;
+            break;
+        }
+        memcpy(output->c, out->s, length);
+        output->c += length;
+
+        uint64_t start = i * band;
+        uint64_t end = input->l - start > band ? start + band : input->l;
+        adler = starlight_combine_adler(
+            adler, bands.bands[i].adler, end - start
+        );
+    }
+
+    if (!status) status = end_zlib(output, adler);
+
+    for (uint64_t i = 0; i < count; i++) free(bands.bands[i].out.s);
+    free(bands.bands);
+    return status;
+}
@@ -0,0 +1,760 @@
+#include "starlight.h"
+
+#include <threads.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * png filter reconstruction of one scanline. `src` holds the filtered
+ * bytes, `prev` the reconstructed scanline above (all zeros for the
+ * first one) and `dst` receives the result. dst may be src, or lie
+ * before it in the same buffer: every kernel reads a pixel before it
+ * writes the pixel at the same offset.
+ *
+ * sub, average and paeth depend on the pixel to the left, so the vector
+ * kernels work one pixel at a time, specialized for 3, 4, 6 and 8 bytes
+ * per pixel. up has no such dependency and runs a whole register wide.
+ * the scalar kernels cover every other case and are the reference the
+ * vector ones match bit for bit.
+ */
+typedef void (*UnfilterKernel)(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+);
+
+static uint32_t starlight_abs(int32_t value) {
+    return value < 0 ? -value : value;
+}
+
+static void sub_scalar(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    (void)prev;
+
+    uint64_t x = 0;
+    for (; x < bpp; x++) dst[x] = src[x];
+    for (; x < length; x++) dst[x] = src[x] + dst[x - bpp];
+}
+
+static void up_scalar(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    (void)bpp;
+
+    for (uint64_t x = 0; x < length; x++) dst[x] = src[x] + prev[x];
+}
+
+static void avg_scalar(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    uint64_t x = 0;
+    for (; x < bpp; x++) dst[x] = src[x] + (prev[x] >> 1);
+    for (; x < length; x++)
+        dst[x] = src[x] + ((dst[x - bpp] + prev[x]) >> 1);
+}
+
+static void paeth_scalar(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    uint64_t x = 0;
+    for (; x < bpp; x++) dst[x] = src[x] + prev[x];
+
+    for (; x < length; x++) {
+        uint8_t a = dst[x - bpp];
+        uint8_t b = prev[x];
+        uint8_t c = prev[x - bpp];
+
+        int32_t p = a + b - c;
+
+        int32_t pa = starlight_abs(p - a);
+        int32_t pb = starlight_abs(p - b);
+        int32_t pc = starlight_abs(p - c);
+
+        if (pa <= pb && pa <= pc) {
+            dst[x] = src[x] + a;
+        } else if (pb <= pc) {
+            dst[x] = src[x] + b;
+        } else {
+            dst[x] = src[x] + c;
+        }
+    }
+}
+
+
+/*
+ * pixels move between memory and vector registers through a 64 bit
+ * integer, in whole 2, 4 and 8 byte accesses. a partial copy through
+ * the stack would stall every pixel on the load after it.
+ */
+static inline uint64_t load_le(const uint8_t *p, uint8_t n) {
+    uint64_t q;
+    uint32_t d;
+    uint16_t w;
+
+    switch (n) {
+    case 3:
+        memcpy(&w, p, 2);
+        return w | (uint64_t)p[2] << 16;
+    case 4:
+        memcpy(&d, p, 4);
+        return d;
+    case 6:
+        memcpy(&d, p, 4);
+        memcpy(&w, p + 4, 2);
+        return d | (uint64_t)w << 32;
+    default:
+        memcpy(&q, p, 8);
+        return q;
+    }
+}
+
+static inline void store_le(uint8_t *p, uint64_t v, uint8_t n) {
+    uint32_t d = (uint32_t)v;
+    uint16_t w = (uint16_t)v;
+
+    switch (n) {
+    case 3:
+        memcpy(p, &w, 2);
+        p[2] = (uint8_t)(v >> 16);
+        break;
+    case 4:
+        memcpy(p, &d, 4);
+        break;
+    case 6:
+        w = (uint16_t)(v >> 32);
+        memcpy(p, &d, 4);
+        memcpy(p + 4, &w, 2);
+        break;
+    default:
+        memcpy(p, &v, 8);
+        break;
+    }
+}
+
+#if defined(__x86_64__)
+// a pixel of up to 8 bytes in the low half of a register
+static inline __m128i load_pixel(const uint8_t *p, uint8_t bpp) {
+    return _mm_cvtsi64_si128(load_le(p, bpp));
+}
+
+static inline void store_pixel(uint8_t *p, __m128i v, uint8_t bpp) {
+    store_le(p, _mm_cvtsi128_si64(v), bpp);
+}
+
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline void sub_sse2(
+    uint8_t *dst, const uint8_t *src, uint64_t length, uint8_t bpp
+) {
+    __m128i a = _mm_setzero_si128();
+    for (uint64_t x = 0; x < length; x += bpp) {
+        a = _mm_add_epi8(a, load_pixel(src + x, bpp));
+        store_pixel(dst + x, a, bpp);
+    }
+}
+
+static inline void avg_sse2(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+
+    for (uint64_t x = 0; x < length; x += bpp) {
+        __m128i b = load_pixel(prev + x, bpp);
+
+        // pavgb rounds up, take the lost low bit back off
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+
+        a = _mm_add_epi8(load_pixel(src + x, bpp), avg);
+        store_pixel(dst + x, a, bpp);
+    }
+}
+
+/*
+ * paeth on 16 bit lanes: p - a = b - c, p - b = a - c and
+ * p - c = (b - c) + (a - c). the predictor is the first of a, b and c
+ * with the smallest distance, the same tie order as the scalar kernel.
+ */
+static inline __m128i paeth_pick(
+    __m128i a, __m128i b, __m128i c,
+    __m128i pa, __m128i pb, __m128i pc
+) {
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest = select_si128(_mm_cmpeq_epi16(smallest, pb), b, c);
+    return select_si128(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+}
+
+static inline __m128i abs_epi16_sse2(__m128i v) {
+    return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+static inline void paeth_sse2(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    for (uint64_t x = 0; x < length; x += bpp) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel(prev + x, bpp), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+
+        __m128i predictor = paeth_pick(
+            a, b, c,
+            abs_epi16_sse2(pa), abs_epi16_sse2(pb), abs_epi16_sse2(pc)
+        );
+
+        __m128i d = _mm_add_epi8(
+            load_pixel(src + x, bpp), _mm_packus_epi16(predictor, zero)
+        );
+        store_pixel(dst + x, d, bpp);
+
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    }
+}
+
+__attribute__((target("ssse3")))
+static inline void paeth_ssse3(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    for (uint64_t x = 0; x < length; x += bpp) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel(prev + x, bpp), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+
+        __m128i predictor = paeth_pick(
+            a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb), _mm_abs_epi16(pc)
+        );
+
+        __m128i d = _mm_add_epi8(
+            load_pixel(src + x, bpp), _mm_packus_epi16(predictor, zero)
+        );
+        store_pixel(dst + x, d, bpp);
+
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    }
+}
+
+static void up_sse2(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    (void)bpp;
+
+    uint64_t x = 0;
+    for (; x + 16 <= length; x += 16) {
+        __m128i v = _mm_add_epi8(
+            _mm_loadu_si128((const __m128i *)(src + x)),
+            _mm_loadu_si128((const __m128i *)(prev + x))
+        );
+        _mm_storeu_si128((__m128i *)(dst + x), v);
+    }
+    for (; x < length; x++) dst[x] = src[x] + prev[x];
+}
+
+__attribute__((target("avx2")))
+static void up_avx2(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    (void)bpp;
+
+    uint64_t x = 0;
+    for (; x + 32 <= length; x += 32) {
+        __m256i v = _mm256_add_epi8(
+            _mm256_loadu_si256((const __m256i *)(src + x)),
+            _mm256_loadu_si256((const __m256i *)(prev + x))
+        );
+        _mm256_storeu_si256((__m256i *)(dst + x), v);
+    }
+    for (; x < length; x++) dst[x] = src[x] + prev[x];
+}
+
+// one instance per pixel size, so every load and store has a fixed width
+#define X86_KERNELS(bpp)\
+static void sub_sse2_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)prev; (void)unused; sub_sse2(dst, src, length, bpp); }\
+static void avg_sse2_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)unused; avg_sse2(dst, src, prev, length, bpp); }\
+static void paeth_sse2_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)unused; paeth_sse2(dst, src, prev, length, bpp); }\
+__attribute__((target("ssse3")))\
+static void paeth_ssse3_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)unused; paeth_ssse3(dst, src, prev, length, bpp); }
+
+X86_KERNELS(3)
+X86_KERNELS(4)
+X86_KERNELS(6)
+X86_KERNELS(8)
+#endif
+
+
+#if defined(__ARM_NEON)
+static inline uint8x8_t load_pixel_neon(const uint8_t *p, uint8_t bpp) {
+    return vcreate_u8(load_le(p, bpp));
+}
+
+static inline void store_pixel_neon(uint8_t *p, uint8x8_t v, uint8_t bpp) {
+    store_le(p, vget_lane_u64(vreinterpret_u64_u8(v), 0), bpp);
+}
+
+static inline void sub_neon(
+    uint8_t *dst, const uint8_t *src, uint64_t length, uint8_t bpp
+) {
+    uint8x8_t a = vdup_n_u8(0);
+    for (uint64_t x = 0; x < length; x += bpp) {
+        a = vadd_u8(a, load_pixel_neon(src + x, bpp));
+        store_pixel_neon(dst + x, a, bpp);
+    }
+}
+
+static inline void avg_neon(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    uint8x8_t a = vdup_n_u8(0);
+    for (uint64_t x = 0; x < length; x += bpp) {
+        // the halving add truncates, exactly (a + b) >> 1
+        uint8x8_t avg = vhadd_u8(a, load_pixel_neon(prev + x, bpp));
+        a = vadd_u8(load_pixel_neon(src + x, bpp), avg);
+        store_pixel_neon(dst + x, a, bpp);
+    }
+}
+
+static inline void paeth_neon(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    uint8x8_t a = vdup_n_u8(0);
+    uint8x8_t c = vdup_n_u8(0);
+
+    for (uint64_t x = 0; x < length; x += bpp) {
+        uint8x8_t b = load_pixel_neon(prev + x, bpp);
+
+        uint16x8_t pa = vabdl_u8(b, c);
+        uint16x8_t pb = vabdl_u8(a, c);
+        uint16x8_t pc = vreinterpretq_u16_s16(vabsq_s16(vaddq_s16(
+            vreinterpretq_s16_u16(vsubl_u8(b, c)),
+            vreinterpretq_s16_u16(vsubl_u8(a, c))
+        )));
+
+        uint16x8_t smallest = vminq_u16(vminq_u16(pa, pb), pc);
+        uint8x8_t use_a = vmovn_u16(vceqq_u16(smallest, pa));
+        uint8x8_t use_b = vmovn_u16(vceqq_u16(smallest, pb));
+        uint8x8_t predictor = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+
+        a = vadd_u8(load_pixel_neon(src + x, bpp), predictor);
+        store_pixel_neon(dst + x, a, bpp);
+        c = b;
+    }
+}
+
+static void up_neon(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+) {
+    (void)bpp;
+
+    uint64_t x = 0;
+    for (; x + 16 <= length; x += 16) {
+        vst1q_u8(dst + x, vaddq_u8(vld1q_u8(src + x), vld1q_u8(prev + x)));
+    }
+    for (; x < length; x++) dst[x] = src[x] + prev[x];
+}
+
+#define NEON_KERNELS(bpp)\
+static void sub_neon_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)prev; (void)unused; sub_neon(dst, src, length, bpp); }\
+static void avg_neon_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)unused; avg_neon(dst, src, prev, length, bpp); }\
+static void paeth_neon_##bpp(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t unused\
+) { (void)unused; paeth_neon(dst, src, prev, length, bpp); }
+
+NEON_KERNELS(3)
+NEON_KERNELS(4)
+NEON_KERNELS(6)
+NEON_KERNELS(8)
+#endif
+
+
+// indexed by filter type and bytes per pixel
+static UnfilterKernel UNFILTER_KERNEL[5][9];
+static once_flag UNFILTER_ONCE = ONCE_FLAG_INIT;
+
+static void pick_unfilter_kernels(void) {
+    for (uint8_t bpp = 1; bpp <= 8; bpp++) {
+        UNFILTER_KERNEL[1][bpp] = sub_scalar;
+        UNFILTER_KERNEL[2][bpp] = up_scalar;
+        UNFILTER_KERNEL[3][bpp] = avg_scalar;
+        UNFILTER_KERNEL[4][bpp] = paeth_scalar;
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool ssse3 = __builtin_cpu_supports("ssse3");
+
+    for (uint8_t bpp = 1; bpp <= 8; bpp++) {
+        UNFILTER_KERNEL[2][bpp] = avx2 ? up_avx2 : up_sse2;
+    }
+
+#define X86_PICK(bpp)\
+    UNFILTER_KERNEL[1][bpp] = sub_sse2_##bpp;\
+    UNFILTER_KERNEL[3][bpp] = avg_sse2_##bpp;\
+    UNFILTER_KERNEL[4][bpp] = ssse3 ? paeth_ssse3_##bpp : paeth_sse2_##bpp;
+
+    X86_PICK(3)
+    X86_PICK(4)
+    X86_PICK(6)
+    X86_PICK(8)
+#undef X86_PICK
+#endif
+
+#if defined(__ARM_NEON)
+    for (uint8_t bpp = 1; bpp <= 8; bpp++) {
+        UNFILTER_KERNEL[2][bpp] = up_neon;
+    }
+
+#define NEON_PICK(bpp)\
+    UNFILTER_KERNEL[1][bpp] = sub_neon_##bpp;\
+    UNFILTER_KERNEL[3][bpp] = avg_neon_##bpp;\
+    UNFILTER_KERNEL[4][bpp] = paeth_neon_##bpp;
+
+    NEON_PICK(3)
+    NEON_PICK(4)
+    NEON_PICK(6)
+    NEON_PICK(8)
+#undef NEON_PICK
+#endif
+}
+
+
+/*
+ * png filtering for the encoder, the inverse of the above. every byte
+ * it writes depends on the source rows only, so each filter runs a whole
+ * register at a time for any pixel size. the kernels also return the sum
+ * of the filtered bytes taken as signed magnitudes, the usual measure
+ * to pick a filter for a row by: the smaller, the better it compresses.
+ */
+typedef uint64_t (*FilterKernel)(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t length, uint8_t bpp
+);
+
+static inline uint8_t magnitude(uint8_t value) {
+    return value < 128 ? value : 256 - value;
+}
+
+static inline uint8_t paeth_predict(uint8_t a, uint8_t b, uint8_t c) {
+    int32_t p = a + b - c;
+
+    uint32_t pa = starlight_abs(p - a);
+    uint32_t pb = starlight_abs(p - b);
+    uint32_t pc = starlight_abs(p - c);
+
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// from byte `x` on, the vector kernels leave the rest of the row to these
+static uint64_t filter_none_from(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t x, uint64_t length, uint8_t bpp
+) {
+    (void)prev;
+    (void)bpp;
+
+    uint64_t sum = 0;
+    for (; x < length; x++) sum += magnitude(dst[x] = src[x]);
+    return sum;
+}
+
+static uint64_t filter_sub_from(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t x, uint64_t length, uint8_t bpp
+) {
+    (void)prev;
+
+    uint64_t sum = 0;
+    for (; x < length; x++) {
+        uint8_t a = x >= bpp ? src[x - bpp] : 0;
+        sum += magnitude(dst[x] = src[x] - a);
+    }
+    return sum;
+}
+
+static uint64_t filter_up_from(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t x, uint64_t length, uint8_t bpp
+) {
+    (void)bpp;
+
+    uint64_t sum = 0;
+    for (; x < length; x++) sum += magnitude(dst[x] = src[x] - prev[x]);
+    return sum;
+}
+
+static uint64_t filter_avg_from(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t x, uint64_t length, uint8_t bpp
+) {
+    uint64_t sum = 0;
+    for (; x < length; x++) {
+        uint8_t a = x >= bpp ? src[x - bpp] : 0;
+        sum += magnitude(dst[x] = src[x] - ((a + prev[x]) >> 1));
+    }
+    return sum;
+}
+
+static uint64_t filter_paeth_from(
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+    uint64_t x, uint64_t length, uint8_t bpp
+) {
+    uint64_t sum = 0;
+    for (; x < length; x++) {
+        uint8_t a = x >= bpp ? src[x - bpp] : 0;
+        uint8_t c = x >= bpp ? prev[x - bpp] : 0;
+        sum += magnitude(dst[x] = src[x] - paeth_predict(a, prev[x], c));
+    }
+    return sum;
+}
+
+#if !defined(__x86_64__) && !defined(__ARM_NEON)
+#define SCALAR_FILTER(name)\
+static uint64_t name##_scalar(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t bpp\
+) { return name##_from(dst, src, prev, 0, length, bpp); }
+
+SCALAR_FILTER(filter_none)
+SCALAR_FILTER(filter_sub)
+SCALAR_FILTER(filter_up)
+SCALAR_FILTER(filter_avg)
+SCALAR_FILTER(filter_paeth)
+#undef SCALAR_FILTER
+#endif
+
+#if defined(__x86_64__) && !defined(__ARM_NEON)
+// the sum of the magnitudes of 16 filtered bytes, in two 64 bit halves
+static inline __m128i magnitude_sum(__m128i sum, __m128i filtered) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i negated = _mm_sub_epi8(zero, filtered);
+    return _mm_add_epi64(
+        sum, _mm_sad_epu8(_mm_min_epu8(filtered, negated), zero)
+    );
+}
+
+static inline uint64_t horizontal_sum(__m128i sum) {
+    return (
+        (uint64_t)_mm_cvtsi128_si64(sum) +
+        (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum))
+    );
+}
+
+/*
+ * the first bpp bytes have no left neighbour and go through the scalar
+ * code, from there on a, b and c are plain loads at a fixed offset
+ */
+#define X86_FILTER(name, body)\
+static uint64_t name##_sse2(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t bpp\
+) {\
+    uint64_t x = length < bpp ? length : bpp;\
+    uint64_t start = name##_from(dst, src, prev, 0, x, bpp);\
+    __m128i sum = _mm_setzero_si128();\
+    for (; x + 16 <= length; x += 16) {\
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + x));\
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + x - bpp));\
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + x));\
+        __m128i c = _mm_loadu_si128((const __m128i *)(prev + x - bpp));\
+        (void)a; (void)b; (void)c;\
+        __m128i d = body;\
+        _mm_storeu_si128((__m128i *)(dst + x), d);\
+        sum = magnitude_sum(sum, d);\
+    }\
+    return start + horizontal_sum(sum) +\
+        name##_from(dst, src, prev, x, length, bpp);\
+}
+
+static inline __m128i widen_half(__m128i v, bool high) {
+    const __m128i zero = _mm_setzero_si128();
+    return high ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+}
+
+static inline __m128i paeth_predict_sse2(__m128i a, __m128i b, __m128i c) {
+    __m128i halves[2];
+
+    for (uint32_t i = 0; i < 2; i++) {
+        __m128i a16 = widen_half(a, i);
+        __m128i b16 = widen_half(b, i);
+        __m128i c16 = widen_half(c, i);
+
+        __m128i pa = _mm_sub_epi16(b16, c16);
+        __m128i pb = _mm_sub_epi16(a16, c16);
+        __m128i pc = _mm_add_epi16(pa, pb);
+
+        halves[i] = paeth_pick(
+            a16, b16, c16,
+            abs_epi16_sse2(pa), abs_epi16_sse2(pb), abs_epi16_sse2(pc)
+        );
+    }
+    return _mm_packus_epi16(halves[0], halves[1]);
+}
+
+static inline __m128i avg_predict_sse2(__m128i a, __m128i b) {
+    __m128i avg = _mm_avg_epu8(a, b);
+    return _mm_sub_epi8(
+        avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1))
+    );
+}
+
+X86_FILTER(filter_none, s)
+X86_FILTER(filter_sub, _mm_sub_epi8(s, a))
+X86_FILTER(filter_up, _mm_sub_epi8(s, b))
+X86_FILTER(filter_avg, _mm_sub_epi8(s, avg_predict_sse2(a, b)))
+X86_FILTER(filter_paeth, _mm_sub_epi8(s, paeth_predict_sse2(a, b, c)))
+#undef X86_FILTER
+#endif
+
+#if defined(__ARM_NEON)
+static inline uint8x8_t paeth_predict_neon(
+    uint8x8_t a, uint8x8_t b, uint8x8_t c
+) {
+    uint16x8_t pa = vabdl_u8(b, c);
+    uint16x8_t pb = vabdl_u8(a, c);
+    uint16x8_t pc = vreinterpretq_u16_s16(vabsq_s16(vaddq_s16(
+        vreinterpretq_s16_u16(vsubl_u8(b, c)),
+        vreinterpretq_s16_u16(vsubl_u8(a, c))
+    )));
+
+    uint16x8_t smallest = vminq_u16(vminq_u16(pa, pb), pc);
+    uint8x8_t use_a = vmovn_u16(vceqq_u16(smallest, pa));
+    uint8x8_t use_b = vmovn_u16(vceqq_u16(smallest, pb));
+    return vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+}
+
+#define NEON_FILTER(name, body)\
+static uint64_t name##_neon(\
+    uint8_t *dst, const uint8_t *src, const uint8_t *prev,\
+    uint64_t length, uint8_t bpp\
+) {\
+    uint64_t x = length < bpp ? length : bpp;\
+    uint64_t start = name##_from(dst, src, prev, 0, x, bpp);\
+    uint32x4_t sum = vdupq_n_u32(0);\
+    for (; x + 16 <= length; x += 16) {\
+        uint8x16_t s = vld1q_u8(src + x);\
+        uint8x16_t a = vld1q_u8(src + x - bpp);\
+        uint8x16_t b = vld1q_u8(prev + x);\
+        uint8x16_t c = vld1q_u8(prev + x - bpp);\
+        (void)a; (void)b; (void)c;\
+        uint8x16_t d = body;\
+        vst1q_u8(dst + x, d);\
+        int8x16_t m = vabsq_s8(vreinterpretq_s8_u8(d));\
+        sum = vpadalq_u16(sum, vpaddlq_u8(vreinterpretq_u8_s8(m)));\
+    }\
+    uint64x2_t halves = vpaddlq_u32(sum);\
+    return start + vgetq_lane_u64(halves, 0) + vgetq_lane_u64(halves, 1) +\
+        name##_from(dst, src, prev, x, length, bpp);\
+}
+
+NEON_FILTER(filter_none, s)
+NEON_FILTER(filter_sub, vsubq_u8(s, a))
+NEON_FILTER(filter_up, vsubq_u8(s, b))
+NEON_FILTER(filter_avg, vsubq_u8(s, vhaddq_u8(a, b)))
+NEON_FILTER(filter_paeth, vsubq_u8(s, vcombine_u8(
+    paeth_predict_neon(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c)),
+    paeth_predict_neon(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c))
+)))
+#undef NEON_FILTER
+#endif
+
+// sse2 is part of x86-64 and neon of arm64, so no runtime check
+static const FilterKernel FILTER_KERNEL[5] = {
+#if defined(__ARM_NEON)
+    filter_none_neon, filter_sub_neon, filter_up_neon,
+    filter_avg_neon, filter_paeth_neon,
+#elif defined(__x86_64__)
+    filter_none_sse2, filter_sub_sse2, filter_up_sse2,
+    filter_avg_sse2, filter_paeth_sse2,
+#else
+    filter_none_scalar, filter_sub_scalar, filter_up_scalar,
+    filter_avg_scalar, filter_paeth_scalar,
+#endif
+};
+
+/*
+ * filter the `length` bytes of `src` against `prev`, the row above it
+ * (all zeros for the first one), into dst. `cost` receives the sum of
+ * the filtered bytes as signed magnitudes when it is not NULL.
+ */
+starlight_status_t starlight_filter_row(
+    uint8_t filter_type, uint8_t *dst, const uint8_t *src,
+    const uint8_t *prev, uint64_t length, uint8_t bpp, uint64_t *cost
+) {
+    if (filter_type > 4 || bpp == 0 || bpp > 8)
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    uint64_t sum = FILTER_KERNEL[filter_type](dst, src, prev, length, bpp);
+    if (cost != NULL) *cost = sum;
+    return STARLIGHT_S_SUCCESS;
+}
+
+starlight_status_t starlight_unfilter_row(
+    uint8_t filter_type, uint8_t *dst, const uint8_t *src,
+    const uint8_t *prev, uint64_t length, uint8_t bpp
+) {
+    if (filter_type > 4 || bpp == 0 || bpp > 8)
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    if (filter_type == 0) {
+        if (dst != src) memmove(dst, src, length);
+        return STARLIGHT_S_SUCCESS;
+    }
+
+    call_once(&UNFILTER_ONCE, pick_unfilter_kernels);
+    UNFILTER_KERNEL[filter_type][bpp](dst, src, prev, length, bpp);
+    return STARLIGHT_S_SUCCESS;
+}
@@ -1,20 +1,43 @@
 
 #include "starlight.h"
 
-#include <assert.h>
-#include <stdlib.h> // mallocing the tree nodes
+#include <stdlib.h>
+#include <threads.h>
 
-typedef struct TreeNode {
-    struct TreeNode *left;
-    struct TreeNode *right;
-    int32_t value;
-} TreeNode;
-
-typedef struct TreeTable {
-    uint8_t min;
-    uint8_t max;
-    int16_t table[1 << 16];
-} TreeTable;
+/*
+ * huffman decode tables: a primary table indexed by the next `bits` bits
+ * of the stream, and subtables for the codes that are longer than that.
+ * every entry is a single uint32_t:
+ *
+ *   31..16  value: literal, base length/distance or subtable start
+ *   15..12  flags
+ *   11..8   extra bits to read after the code (subtable index bits)
+ *    7..0   code length to consume (primary bits for a subtable pointer)
+ */
+#define HUFF_LITERAL  0x8000
+#define HUFF_END      0x4000
+#define HUFF_SUBTABLE 0x2000
+#define HUFF_INVALID  0x1000
+
+#define HUFF_ENTRY(value, flags, extra, length) (\
+    ((uint32_t)(value) << 16) | (flags) | ((extra) << 8) | (length)\
+)
+#define HUFF_VALUE(entry) ((entry) >> 16)
+#define HUFF_EXTRA(entry) (((entry) >> 8) & 15)
+#define HUFF_LENGTH(entry) ((entry) & 0xff)
+
+#define LITLEN_TABLE_BITS 10
+#define DIST_TABLE_BITS 8
+#define CL_TABLE_BITS 7
+
+// primary table plus room for the worst case subtables
+#define HUFF_TABLE_SIZE 2048
+#define MAX_CODE_LENGTH 15
+
+typedef struct HuffTable {
+    uint8_t bits; // primary table index bits
+    uint32_t entries[HUFF_TABLE_SIZE];
+} HuffTable;
 
 
 /*
@@ -27,400 +50,911 @@ printf("\n")
 #define log(...)
 
 
-static uint16_t u16_be(StarlightBuffer *buffer) {
-    uint8_t a = *buffer->c++;
-    uint8_t b = *buffer->c++;
+/*
+ * bit reader: a 64 bit accumulator that is refilled a whole word at a time.
+ * the next bit of the stream is always the lowest bit of `bits`.
+ * after a refill at least BITS_AVAILABLE bits can be peeked and consumed.
+ * the input may be split over several segments (the idat chunks of a png),
+ * the reader pulls the next one from its source when the current runs out.
+ */
+#define BITS_AVAILABLE 56
+
+typedef struct BitReader {
+    uint8_t *c; // cursor
+    uint8_t *e; // end of the current segment
+    StarlightSource *source; // the rest of the input, may be NULL
+    uint64_t bits;
+    uint8_t count; // number of valid bits in `bits`
+    uint8_t overrun; // number of zero bytes fed past the end of input
+} BitReader;
+
+static bool next_segment(BitReader *br) {
+    if (br->source == NULL) return false;
+
+    StarlightBuffer span;
+    while (br->source->next(br->source, &span)) {
+        br->c = span.s;
+        br->e = span.s + span.l;
+        if (br->c < br->e) return true;
+    }
+    return false;
+}
+
+static inline uint64_t load_u64_le(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
 
-    return (a << 8) + (b);
+// the caller guarantees at least 8 readable bytes at the cursor
+static inline void refill_fast(BitReader *br) {
+    br->bits |= load_u64_le(br->c) << br->count;
+    br->c += (63 - br->count) >> 3;
+    br->count |= 56;
 }
 
-static uint8_t read_bit(StarlightBuffer *buffer) {
-    uint8_t c = (*buffer->c >> buffer->bdx) & 1;
-    buffer->bdx++;
-    if (buffer->bdx >= 8) {
-        buffer->c++;
-        buffer->bdx= 0;
+static inline void refill(BitReader *br) {
+    if (br->e - br->c >= 8) {
+        refill_fast(br);
+        return;
     }
-    return c;
-}
 
-static uint32_t read_bits_be(StarlightBuffer *buffer, uint8_t count) {
-    uint32_t o = 0;
-    for (uint8_t ta = 0; ta < count; ta++) {
-        o |= read_bit(buffer) << ta;
+    // near the end of input, feed zeros and remember how many
+    while (br->count < 56) {
+        if (br->c < br->e || next_segment(br)) {
+            br->bits |= (uint64_t)*br->c++ << br->count;
+        } else {
+            br->overrun++;
+        }
+        br->count += 8;
     }
-    return o;
 }
 
-inline static int16_t read_node(StarlightBuffer *input, TreeTable *tree) {
-    uint8_t n = 0;
-    uint16_t code = 1;
-    for (; n < tree->min; n++) {
-        code = (code << 1) | read_bit(input);
+static inline uint32_t peek_bits(BitReader *br, uint8_t n) {
+    return br->bits & ((1ull << n) - 1);
+}
+
+static inline void consume_bits(BitReader *br, uint8_t n) {
+    br->bits >>= n;
+    br->count -= n;
+}
+
+static inline uint32_t read_bits(BitReader *br, uint8_t n) {
+    if (br->count < n) refill(br);
+    uint32_t value = peek_bits(br, n);
+    consume_bits(br, n);
+    return value;
+}
+
+// true once bits past the end of input have been consumed
+static inline bool overran(BitReader *br) {
+    return br->overrun * 8 > br->count;
+}
+
+// whole bytes still sitting in the accumulator that came from the input
+static inline uint8_t buffered_bytes(BitReader *br) {
+    uint8_t whole = br->count >> 3;
+    return whole > br->overrun ? whole - br->overrun : 0;
+}
+
+/*
+ * byte aligned read: the whole bytes left in the accumulator come first,
+ * the rest is copied straight from the input segments.
+ * the caller must have dropped the bits up to the byte boundary.
+ */
+static bool read_bytes(BitReader *br, uint8_t *dst, uint64_t n) {
+    if (overran(br)) return false;
+
+    for (uint8_t b = buffered_bytes(br); b && n; b--, n--) {
+        *dst++ = peek_bits(br, 8);
+        consume_bits(br, 8);
     }
 
-    for (; n < tree->max + 1; n++) {
-        int16_t symbol = tree->table[code];
-        if (symbol != -1) return symbol;
-        code = (code << 1) | read_bit(input);
+    if (!n) return true;
+
+    // the accumulator is empty, drop the look-ahead bits of refill_fast
+    br->bits = 0;
+    br->count = 0;
+    br->overrun = 0;
+
+    while (n) {
+        if (br->c == br->e && !next_segment(br)) return false;
+
+        uint64_t chunk = br->e - br->c;
+        if (chunk > n) chunk = n;
+
+        memcpy(dst, br->c, chunk);
+        dst += chunk;
+        br->c += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+// the caller guarantees at least MAX_CODE_LENGTH bits in the accumulator
+static inline uint32_t lookup_entry(BitReader *br, const HuffTable *table) {
+    uint32_t entry = table->entries[peek_bits(br, table->bits)];
+    if (entry & HUFF_SUBTABLE) {
+        consume_bits(br, HUFF_LENGTH(entry));
+        entry = table->entries[
+            HUFF_VALUE(entry) + peek_bits(br, HUFF_EXTRA(entry))
+        ];
     }
 
-    return -1;
+    consume_bits(br, HUFF_LENGTH(entry));
+    return entry;
 }
 
-static starlight_status_t decode_fixed(
-    StarlightBuffer *input, StarlightBuffer *output
-);
-static starlight_status_t decode_dynamic(
-    StarlightBuffer *input, StarlightBuffer *output
-);
-static starlight_status_t build_tree(
-    uint8_t *code_lengths, uint16_t array_length, TreeTable *tree
-);
-static starlight_status_t parse_data(
-    StarlightBuffer *input, StarlightBuffer *output,
-    TreeTable *ll_tree, TreeTable *dist_tree
+static inline uint32_t decode_entry(BitReader *br, const HuffTable *table) {
+    if (br->count < MAX_CODE_LENGTH) refill(br);
+    return lookup_entry(br, table);
+}
+
+/*
+ * the decoder is a resumable state machine. a one-shot inflate runs it
+ * over the whole input and output at once. a streaming inflate runs it
+ * over whatever input has arrived (`partial`) into a sliding window
+ * (`windowed`); it then stops at a symbol boundary with INFLATE_NEED_INPUT
+ * or INFLATE_NEED_OUTPUT instead of reporting corrupt data.
+ */
+#define INFLATE_NEED_INPUT ((starlight_status_t)(STARLIGHT_S_LENGTH + 1))
+#define INFLATE_NEED_OUTPUT ((starlight_status_t)(STARLIGHT_S_LENGTH + 2))
+
+typedef enum {
+    INFLATE_ZLIB_HEADER,
+    INFLATE_BLOCK_HEADER,
+    INFLATE_STORED,
+    INFLATE_HUFFMAN,
+    INFLATE_TRAILER,
+    INFLATE_DONE,
+} inflate_state_t;
+
+typedef struct Inflater {
+    inflate_state_t state;
+    uint32_t options;
+    bool partial; // more input may arrive after the current span
+    bool windowed; // the output is a window that can be flushed
+    bool final; // the current block is the last one
+    uint16_t stored_left; // bytes left in the current stored block
+    uint32_t adler; // the adler-32 from the zlib trailer
+
+    BitReader br;
+
+    const HuffTable *ll_table;
+    const HuffTable *dist_table;
+    HuffTable ll;
+    HuffTable dist;
+} Inflater;
+
+static void use_fixed_tables(Inflater *z);
+static starlight_status_t decode_dynamic(Inflater *z);
+static starlight_status_t build_table(
+    const uint8_t *code_lengths, uint16_t array_length,
+    uint32_t (*symbol_entry)(uint16_t symbol), HuffTable *table
 );
+static starlight_status_t parse_data(Inflater *z, StarlightBuffer *output);
+
+
+static void init_inflater(Inflater *z, uint32_t options) {
+    z->state = INFLATE_ZLIB_HEADER;
+    z->options = options;
+    z->partial = false;
+    z->windowed = false;
+    z->final = false;
+    z->stored_left = 0;
+    z->adler = 0;
+    z->br = (BitReader) {
+        .c = NULL, .e = NULL, .source = NULL,
+        .bits = 0, .count = 0, .overrun = 0
+    };
+    z->ll.bits = LITLEN_TABLE_BITS;
+    z->dist.bits = DIST_TABLE_BITS;
+}
+
+// whole bytes that can be read right now, without pulling a new segment
+static inline uint64_t available_bytes(BitReader *br) {
+    return buffered_bytes(br) + (br->e - br->c);
+}
+
+/*
+ * runs the decoder until the stream is done or it has to stop.
+ * a step that runs out of input is rolled back to where it started, so
+ * it can be retried as a whole once more input has arrived.
+ */
+static starlight_status_t inflate_run(Inflater *z, StarlightBuffer *output) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    BitReader *br = &z->br;
+
+    while (z->state != INFLATE_DONE) {
+        BitReader checkpoint = *br;
+
+        switch (z->state) {
+            case INFLATE_ZLIB_HEADER: {
+                uint8_t header[2];
+                if (!read_bytes(br, header, 2)) {
+                    status = (
+                        z->partial ? INFLATE_NEED_INPUT :
+                        STARLIGHT_S_CORRUPT_DATA
+                    );
+                    break;
+                }
 
+                uint8_t cfm = header[0];
+                uint8_t flg = header[1];
+                if (flg & 32 || (cfm * 256 + flg) % 31) {
+                    log("preset dict: %d", flg & 32);
+                    return STARLIGHT_S_CORRUPT_DATA;
+                }
 
+                // starlight->png.z_comp_method = cfm & 15;
+                // starlight->png.z_win_size = 1 << (8 + (cfm >> 4));
+                // starlight->png.z_comp_level = flg >> 6;
 
+                log("comp method: %d", cfm & 15);
+                log("win size: %d", 1 << (8 + (cfm >> 4)));
+                log("comp level: %d", flg >> 6);
 
-starlight_status_t starlight_inflate(
-    StarlightBuffer *input, StarlightBuffer *output
+                z->state = INFLATE_BLOCK_HEADER;
+            } break;
+
+            case INFLATE_BLOCK_HEADER: {
+                if (z->final) {
+                    z->state = INFLATE_TRAILER;
+                    break;
+                }
+
+                bool final = read_bits(br, 1);
+                uint8_t type = read_bits(br, 2);
+                inflate_state_t next = INFLATE_HUFFMAN;
+
+                log("final: %d - type: %d", final, type);
+
+                if (type == 0) {
+                    // skip to the byte boundary
+                    consume_bits(br, br->count & 7);
+
+                    uint16_t data_len = read_bits(br, 16);
+                    uint16_t data_nlen = read_bits(br, 16);
+                    if (data_len != ((~data_nlen) & 0xffff)) {
+                        status = STARLIGHT_S_CORRUPT_DATA;
+                        break;
+                    }
+
+                    z->stored_left = data_len;
+                    next = INFLATE_STORED;
+                } else if (type == 1) {
+                    use_fixed_tables(z);
+                } else if (type == 2) {
+                    if ((status = decode_dynamic(z)))
+                        break;
+                } else {
+                    status = STARLIGHT_S_CORRUPT_DATA;
+                    break;
+                }
+
+                // only a complete header moves the decoder on
+                if (overran(br)) {
+                    status = STARLIGHT_S_CORRUPT_DATA;
+                    break;
+                }
+
+                z->final = final;
+                z->state = next;
+            } break;
+
+            case INFLATE_STORED: {
+                // stored data is byte aligned, copy it straight from the input
+                while (z->stored_left) {
+                    uint64_t n = z->stored_left;
+                    uint64_t room = output->e - output->c;
+
+                    if (z->partial || z->windowed) {
+                        uint64_t available = available_bytes(br);
+                        if (!available && z->partial)
+                            return INFLATE_NEED_INPUT;
+                        if (!room && z->windowed)
+                            return INFLATE_NEED_OUTPUT;
+
+                        if (z->partial && n > available) n = available;
+                        if (z->windowed && n > room) n = room;
+                    }
+
+                    if (n > room || !read_bytes(br, output->c, n))
+                        return STARLIGHT_S_CORRUPT_DATA;
+
+                    output->c += n;
+                    z->stored_left -= n;
+                }
+
+                z->state = INFLATE_BLOCK_HEADER;
+            } break;
+
+            case INFLATE_HUFFMAN: {
+                status = parse_data(z, output);
+                if (status == STARLIGHT_S_SUCCESS)
+                    z->state = INFLATE_BLOCK_HEADER;
+                else
+                    return status;
+            } break;
+
+            case INFLATE_TRAILER: {
+                if (z->options & STARLIGHT_O_SKIP_ADLER) {
+                    z->state = INFLATE_DONE;
+                    break;
+                }
+
+                consume_bits(br, br->count & 7);
+
+                uint8_t trailer[4];
+                if (!read_bytes(br, trailer, 4)) {
+                    status = (
+                        z->partial ? INFLATE_NEED_INPUT :
+                        STARLIGHT_S_CORRUPT_DATA
+                    );
+                    break;
+                }
+
+                z->adler = (
+                    ((uint32_t)trailer[0] << 24) | (trailer[1] << 16) |
+                    (trailer[2] << 8) | trailer[3]
+                );
+                z->state = INFLATE_DONE;
+            } break;
+
+            case INFLATE_DONE:
+            break;
+        }
+
+        if (status) {
+            // a step cut off by the end of a partial input is rolled back,
+            // the zero bits fed past the end may decode as anything
+            if (status == INFLATE_NEED_INPUT || (z->partial && overran(br))) {
+                *br = checkpoint;
+                return INFLATE_NEED_INPUT;
+            }
+
+            return status;
+        }
+    }
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+static starlight_status_t inflate(
+    BitReader *br, StarlightBuffer *output, uint32_t options
 ) {
     starlight_status_t status = STARLIGHT_S_SUCCESS;
 
-    input->c = input->s;
     output->c = output->s;
+    output->e = output->s + output->l;
+
+    Inflater z;
+    init_inflater(&z, options);
+    z.br = *br;
 
-    uint8_t cfm = *input->c++;
-    uint8_t flg = *input->c++;
-    if (flg & 32 || (cfm * 256 + flg) % 31) {
-        log("preset dict: %d", flg & 32);
+    status = inflate_run(&z, output);
+    *br = z.br;
+
+    if (status)
+        return status;
+
+    if (options & STARLIGHT_O_SKIP_ADLER)
+        return STARLIGHT_S_SUCCESS;
+
+    if (z.adler != starlight_calc_adler(output->s, output->c - output->s)) {
+        log("adler mismatch");
         return STARLIGHT_S_CORRUPT_DATA;
     }
 
-    // starlight->png.z_comp_method = cfm & 15;
-    // starlight->png.z_win_size = 1 << (8 + (cfm >> 4));
-    // starlight->png.z_comp_level = flg >> 6;
+    return STARLIGHT_S_SUCCESS;
+}
 
-    // log("comp method: %d", starlight->png.z_comp_method);
-    // log("win size: %d", starlight->png.z_win_size);
-    // log("comp level: %d", starlight->png.z_comp_level);
+starlight_status_t starlight_inflate(
+    StarlightBuffer *input, StarlightBuffer *output, uint32_t options
+) {
+    input->c = input->s;
+    input->e = input->s + input->l;
 
-    log("comp method: %d", cfm & 15);
-    log("win size: %d", 1 << (8 + (cfm >> 4)));
-    log("comp level: %d", flg >> 6);
+    BitReader br = {
+        .c = input->c, .e = input->e, .source = NULL,
+        .bits = 0, .count = 0, .overrun = 0
+    };
 
-    bool final = false;
-    uint8_t type = 0;
+    starlight_status_t status = inflate(&br, output, options);
+    input->c = br.c - buffered_bytes(&br);
+    return status;
+}
 
-    while (!final) {
-        final = read_bit(input);
-        type = read_bits_be(input, 2);
+/*
+ * inflate a zlib stream that arrives in spans handed out by `source`,
+ * such as the idat chunks of a png, without joining them first.
+ */
+starlight_status_t starlight_inflate_source(
+    StarlightSource *source, StarlightBuffer *output, uint32_t options
+) {
+    BitReader br = {
+        .c = NULL, .e = NULL, .source = source,
+        .bits = 0, .count = 0, .overrun = 0
+    };
 
-        log("final: %d - type: %d", final, type);
+    return inflate(&br, output, options);
+}
 
-        if (type == 0) {
-            if (input->bdx) {
-                input->bdx = 0;
-                input->c++;
-            }
+typedef struct SegmentList {
+    StarlightBuffer *segments;
+    uint32_t count;
+    uint32_t index;
+} SegmentList;
 
-            uint16_t data_len = u16_be(input);
-            uint16_t data_nlen = u16_be(input);
-            if (data_len != ((~data_nlen) & 0xffff))
-                return STARLIGHT_S_CORRUPT_DATA;
+static bool next_listed_segment(
+    StarlightSource *source, StarlightBuffer *span
+) {
+    SegmentList *list = source->data;
+    if (list->index >= list->count) return false;
 
-            // uint16_t data_len = (
-            //     read_bits_be(starlight, 8) | (read_bits_be(starlight, 8) << 8)
-            // );
-            // uint16_t data_len = (
-            //     read_bits_be(starlight, 8) | (read_bits_be(starlight, 8) << 8)
-            // );
-            // uint16_t data_nlen = read_bits(8) | (read_bits(8) << 8);
-
-            memcpy(output->c, input->c, data_len);
-            output->c += data_len;
-            input->c += data_len;
-        } else if (type == 1) {
-            if ((status = decode_fixed(input, output)))
-                return status;
-        } else if (type == 2) {
-            if ((status = decode_dynamic(input, output)))
-                return status;
-        } else {
-            return STARLIGHT_S_CORRUPT_DATA;
-        }
-    }
+    *span = list->segments[list->index++];
+    return true;
+}
 
-    return STARLIGHT_S_SUCCESS;
+starlight_status_t starlight_inflate_segments(
+    StarlightBuffer *segments, uint32_t count,
+    StarlightBuffer *output, uint32_t options
+) {
+    SegmentList list = { .segments = segments, .count = count, .index = 0 };
+    StarlightSource source = { .next = next_listed_segment, .data = &list };
+    return starlight_inflate_source(&source, output, options);
 }
 
 
-static const uint8_t CL_ORDER[19] = {
-    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+/*
+ * push inflate: the input arrives in pieces through starlight_inflate_feed
+ * and leaves through the sink as it is decoded. only the output the
+ * back-references can still reach is kept: the last 32 KiB of a window
+ * that is slid forward whenever it fills up. the input of a step that
+ * is cut off at the end of a piece is carried over to the next one.
+ */
+#define WINDOW_HISTORY 32768
+#define WINDOW_SIZE (2 * WINDOW_HISTORY)
+#define CARRY_SIZE 1024 // more than the longest dynamic block header
+
+struct starlight_inflate_stream_t {
+    Inflater z;
+    starlight_status_t status;
+
+    StarlightSink sink;
+    void *user;
+    uint32_t adler; // of everything handed to the sink
+
+    StarlightBuffer window;
+    uint8_t *flushed; // window bytes before this went to the sink
+
+    uint64_t carry_length;
+    uint8_t carry[CARRY_SIZE];
+    uint8_t window_data[WINDOW_SIZE];
 };
 
-static const uint16_t LENGTH_BASE[31] = {
-   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 
-   15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 
-   67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0
-};
+starlight_status_t starlight_inflate_begin(
+    StarlightInflateStream **stream,
+    StarlightSink sink, void *user, uint32_t options
+) {
+    StarlightInflateStream *s = malloc(sizeof(StarlightInflateStream));
+    if (s == NULL) return STARLIGHT_S_MALLOC_FAILED;
 
-static const uint8_t LENGTH_EXTRA[31] = {
-    0, 0, 0, 0, 0, 0, 0, 0,
-    1, 1, 1, 1, 2, 2, 2, 2,
-    3, 3, 3, 3, 4, 4, 4, 4,
-    5, 5, 5, 5, 0, 0, 0
-};
+    *stream = s;
+    return starlight_inflate_reset(s, sink, user, options);
+}
 
-static const uint32_t DIST_BASE[32] = {
-    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 
-    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
-    8193, 12289, 16385, 24577, 0, 0
-};
+uint64_t starlight_inflate_stream_size(void) {
+    return sizeof(StarlightInflateStream);
+}
 
-static const uint8_t DIST_EXTRA[32] = {
-    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
-    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
-};
+// start a new stream in one that is through, keeping its memory
+starlight_status_t starlight_inflate_reset(
+    StarlightInflateStream *s,
+    StarlightSink sink, void *user, uint32_t options
+) {
+    init_inflater(&s->z, options);
+    s->z.partial = true;
+    s->z.windowed = true;
+
+    s->status = STARLIGHT_S_SUCCESS;
+    s->sink = sink;
+    s->user = user;
+    s->adler = starlight_update_adler(1, NULL, 0);
+
+    s->window = (StarlightBuffer) {
+        .s = s->window_data, .c = s->window_data,
+        .e = s->window_data + WINDOW_SIZE, .l = WINDOW_SIZE
+    };
+    s->flushed = s->window.s;
+    s->carry_length = 0;
+    return STARLIGHT_S_SUCCESS;
+}
 
-static uint8_t FIXED_LENGTHS[288] = {
-    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-    8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-    9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-    9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-    9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
-};
+static starlight_status_t flush_window(StarlightInflateStream *s) {
+    uint64_t length = s->window.c - s->flushed;
+    if (!length) return STARLIGHT_S_SUCCESS;
 
-static uint8_t FIXED_DIST[32] = {
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-};
+    if (!(s->z.options & STARLIGHT_O_SKIP_ADLER))
+        s->adler = starlight_update_adler(s->adler, s->flushed, length);
 
+    uint8_t *data = s->flushed;
+    s->flushed = s->window.c;
+    return s->sink(s->user, data, length);
+}
 
-static starlight_status_t decode_fixed(
-    StarlightBuffer *input, StarlightBuffer *output
-) {
+// decode as far as the input goes, sliding the window as it fills up
+static starlight_status_t run_stream(StarlightInflateStream *s) {
     starlight_status_t status = STARLIGHT_S_SUCCESS;
 
-    // TreeNode ll_root;
-    TreeTable ll_tree;
-    if ((status = build_tree(FIXED_LENGTHS, 288, &ll_tree)))
+    while (true) {
+        status = inflate_run(&s->z, &s->window);
+
+        starlight_status_t sink_status = flush_window(s);
+        if (sink_status) return sink_status;
+
+        if (status != INFLATE_NEED_OUTPUT) break;
+
+        memmove(s->window.s, s->window.c - WINDOW_HISTORY, WINDOW_HISTORY);
+        s->window.c = s->window.s + WINDOW_HISTORY;
+        s->flushed = s->window.c;
+    }
+
+    if (status == INFLATE_NEED_INPUT) {
+        // the zero bytes fed past the end are not part of the stream
+        s->z.br.count -= s->z.br.overrun * 8;
+        s->z.br.overrun = 0;
         return status;
+    }
 
-    // TreeNode dist_root;
-    TreeTable dist_tree;
-    if ((status = build_tree(FIXED_DIST, 32, &dist_tree)))
+    if (status)
         return status;
 
-    return parse_data(input, output, &ll_tree, &dist_tree);
-}
+    if (s->z.options & STARLIGHT_O_SKIP_ADLER)
+        return STARLIGHT_S_SUCCESS;
+
+    if (s->adler != s->z.adler) {
+        log("adler mismatch");
+        return STARLIGHT_S_CORRUPT_DATA;
+    }
 
+    return STARLIGHT_S_SUCCESS;
+}
 
-static starlight_status_t decode_dynamic(
-    StarlightBuffer *input, StarlightBuffer *output
+starlight_status_t starlight_inflate_feed(
+    StarlightInflateStream *s, const uint8_t *data, uint64_t length
 ) {
+    if (s->status || s->z.state == INFLATE_DONE)
+        return s->status;
+
+    // the reader never writes through its cursor
+    uint8_t *c = (uint8_t *)data;
+    uint8_t *e = c + length;
+    starlight_status_t status = INFLATE_NEED_INPUT;
+
+    while (c < e) {
+        if (!s->carry_length) {
+            s->z.br.c = c;
+            s->z.br.e = e;
+            if ((status = run_stream(s)) != INFLATE_NEED_INPUT)
+                break;
+
+            uint64_t left = s->z.br.e - s->z.br.c;
+            if (left > CARRY_SIZE) {
+                status = STARLIGHT_S_CORRUPT_DATA;
+                break;
+            }
+
+            memcpy(s->carry, s->z.br.c, left);
+            s->carry_length = left;
+            return STARLIGHT_S_SUCCESS;
+        }
+
+        // top up the carried bytes with the new ones and decode from there
+        uint64_t carried = s->carry_length;
+        uint64_t take = CARRY_SIZE - carried;
+        if (take > (uint64_t)(e - c)) take = e - c;
+
+        memcpy(s->carry + carried, c, take);
+        c += take;
+        s->carry_length += take;
+
+        s->z.br.c = s->carry;
+        s->z.br.e = s->carry + s->carry_length;
+        if ((status = run_stream(s)) != INFLATE_NEED_INPUT)
+            break;
+
+        uint64_t used = s->z.br.c - s->carry;
+        if (used >= carried) {
+            // the rest is still in place in the new piece
+            c -= s->carry_length - used;
+            s->carry_length = 0;
+            continue;
+        }
+
+        if (!used && s->carry_length == CARRY_SIZE) {
+            status = STARLIGHT_S_CORRUPT_DATA;
+            break;
+        }
+
+        memmove(s->carry, s->carry + used, s->carry_length - used);
+        s->carry_length -= used;
+    }
+
+    if (status == INFLATE_NEED_INPUT)
+        return STARLIGHT_S_SUCCESS;
+
+    s->status = status;
+    return status;
+}
+
+// no more input: the stream has to be complete. frees the stream
+starlight_status_t starlight_inflate_end(StarlightInflateStream *s) {
+    starlight_status_t status = starlight_inflate_finish(s);
+    free(s);
+    return status;
+}
+
+// starlight_inflate_end, but the stream is kept for a reset
+starlight_status_t starlight_inflate_finish(StarlightInflateStream *s) {
+    starlight_status_t status = s->status;
+
+    if (!status && s->z.state != INFLATE_DONE) {
+        s->z.partial = false;
+        s->z.br.c = s->carry;
+        s->z.br.e = s->carry + s->carry_length;
+
+        if ((status = run_stream(s)) == INFLATE_NEED_INPUT)
+            status = STARLIGHT_S_CORRUPT_DATA;
+    }
+
+    s->status = status;
+    return status;
+}
+
+
+static uint32_t ll_entry(uint16_t symbol) {
+    if (symbol < 256) return HUFF_ENTRY(symbol, HUFF_LITERAL, 0, 0);
+    if (symbol == 256) return HUFF_ENTRY(0, HUFF_END, 0, 0);
+
+    symbol -= 257;
+    if (symbol >= 29) return HUFF_ENTRY(0, HUFF_INVALID, 0, 0);
+    return HUFF_ENTRY(
+        STARLIGHT_LENGTH_BASE[symbol], 0, STARLIGHT_LENGTH_EXTRA[symbol], 0
+    );
+}
+
+static uint32_t dist_entry(uint16_t symbol) {
+    if (symbol >= 30) return HUFF_ENTRY(0, HUFF_INVALID, 0, 0);
+    return HUFF_ENTRY(
+        STARLIGHT_DIST_BASE[symbol], 0, STARLIGHT_DIST_EXTRA[symbol], 0
+    );
+}
+
+static uint32_t cl_entry(uint16_t symbol) {
+    return HUFF_ENTRY(symbol, 0, 0, 0);
+}
+
+
+/*
+ * the fixed tables never change, so they are built once per process
+ * and shared by every starlight_inflate call and thread.
+ */
+static HuffTable FIXED_LL_TABLE = { .bits = LITLEN_TABLE_BITS };
+static HuffTable FIXED_DIST_TABLE = { .bits = DIST_TABLE_BITS };
+static once_flag FIXED_TABLES_ONCE = ONCE_FLAG_INIT;
+
+static void build_fixed_tables(void) {
+    // the fixed code lengths are complete and can not fail to build
+    build_table(
+        STARLIGHT_FIXED_LITLEN_LENGTHS, 288, ll_entry, &FIXED_LL_TABLE
+    );
+    build_table(
+        STARLIGHT_FIXED_DIST_LENGTHS, 32, dist_entry, &FIXED_DIST_TABLE
+    );
+}
+
+static void use_fixed_tables(Inflater *z) {
+    call_once(&FIXED_TABLES_ONCE, build_fixed_tables);
+    z->ll_table = &FIXED_LL_TABLE;
+    z->dist_table = &FIXED_DIST_TABLE;
+}
+
+
+// read the code lengths of a dynamic block and build its tables
+static starlight_status_t decode_dynamic(Inflater *z) {
     starlight_status_t status = STARLIGHT_S_SUCCESS;
+    BitReader *input = &z->br;
 
-    uint8_t hlit = read_bits_be(input, 5);
+    uint8_t hlit = read_bits(input, 5);
     uint16_t num_ll_codes = hlit + 257;
 
-    uint8_t hdist = read_bits_be(input, 5);
+    uint8_t hdist = read_bits(input, 5);
     uint8_t num_dist_codes = hdist + 1;
 
-    uint8_t hclen = read_bits_be(input, 4);
+    uint8_t hclen = read_bits(input, 4);
     uint8_t num_cl_codes = hclen + 4;
 
+    if (num_ll_codes > 286 || num_dist_codes > 30)
+        return STARLIGHT_S_CORRUPT_DATA;
+
     uint8_t cl_code_lengths[19];
     memset(cl_code_lengths, 0, sizeof(cl_code_lengths));
 
     for (uint8_t ci = 0; ci < num_cl_codes; ci++) {
-        cl_code_lengths[CL_ORDER[ci]] = read_bits_be(input, 3);
+        cl_code_lengths[STARLIGHT_CL_ORDER[ci]] = read_bits(input, 3);
     }
 
-    TreeTable cl_tree;
-
-    // TreeNode cl_root;
-    if ((status = build_tree(cl_code_lengths, 19, &cl_tree))) {
-        log("cl root build tree faild");
+    HuffTable cl_table = { .bits = CL_TABLE_BITS };
+    if ((status = build_table(cl_code_lengths, 19, cl_entry, &cl_table))) {
+        log("cl table build faild");
         return status;
     }
 
-    uint8_t ll_code_lengths[288];
-    uint8_t dist_code_lengths[32];
-    memset(ll_code_lengths, 0, sizeof(ll_code_lengths));
-    memset(dist_code_lengths, 0, sizeof(dist_code_lengths));
+    // literal/length and distance code lengths are one continuous sequence
+    uint8_t code_lengths[286 + 30];
+    uint16_t total = num_ll_codes + num_dist_codes;
 
     uint8_t repeat_count = 0;
-    uint16_t repeat_symbol = 0;
-    int32_t symbol = 0;
+    uint8_t repeat_symbol = 0;
 
-    // TreeNode *node = &cl_root;
-
-    for (uint16_t ix=0; ix < num_ll_codes + num_dist_codes;) {
-        if ((symbol = read_node(input, &cl_tree)) == -1)
+    for (uint16_t ix = 0; ix < total;) {
+        uint32_t entry = decode_entry(input, &cl_table);
+        if (entry & HUFF_INVALID)
             return STARLIGHT_S_CORRUPT_DATA;
 
-        // symbol = node->value;
+        uint16_t symbol = HUFF_VALUE(entry);
         if (symbol <= 15) {
-            if (ix >= num_ll_codes) {
-                dist_code_lengths[ix - num_ll_codes] = symbol;
-            } else {
-                ll_code_lengths[ix] = symbol;
-            }
-            ix++;
-            repeat_count = 0;
-            repeat_symbol = symbol;
-        } else if (symbol == 16) {
-            repeat_count = read_bits_be(input, 2) + 3;
+            code_lengths[ix++] = symbol;
+            continue;
+        }
+
+        if (symbol == 16) {
+            if (!ix) return STARLIGHT_S_CORRUPT_DATA;
+            repeat_symbol = code_lengths[ix - 1];
+            repeat_count = read_bits(input, 2) + 3;
         } else if (symbol == 17) {
-            repeat_count = read_bits_be(input, 3) + 3;
-            repeat_symbol = 0;
-        } else if (symbol == 18) {
-            repeat_count = read_bits_be(input, 7) + 11;
             repeat_symbol = 0;
+            repeat_count = read_bits(input, 3) + 3;
         } else {
-            return STARLIGHT_S_CORRUPT_DATA;
+            repeat_symbol = 0;
+            repeat_count = read_bits(input, 7) + 11;
         }
 
-        for (uint8_t ih=0; ih < repeat_count; ih++) {
-            if (ix >= num_ll_codes) {
-                dist_code_lengths[ix - num_ll_codes] = repeat_symbol;
-            } else {
-                ll_code_lengths[ix] = repeat_symbol;
-            }
-            ix++;
-        }
+        if (ix + repeat_count > total)
+            return STARLIGHT_S_CORRUPT_DATA;
+
+        memset(code_lengths + ix, repeat_symbol, repeat_count);
+        ix += repeat_count;
     }
 
-    // return STARLIGHT_S_NOT_IMPLEMENTED;
+    // the end of block code must exist
+    if (overran(input) || !code_lengths[256])
+        return STARLIGHT_S_CORRUPT_DATA;
 
-    TreeTable ll_root;
-    build_tree(ll_code_lengths, num_ll_codes, &ll_root);
+    if ((status = build_table(
+        code_lengths, num_ll_codes, ll_entry, &z->ll
+    ))) return status;
 
-    TreeTable dist_root;
-    build_tree(dist_code_lengths, num_dist_codes, &dist_root);
+    if ((status = build_table(
+        code_lengths + num_ll_codes, num_dist_codes, dist_entry, &z->dist
+    ))) return status;
 
-    return parse_data(input, output, &ll_root, &dist_root);
+    z->ll_table = &z->ll;
+    z->dist_table = &z->dist;
+    return STARLIGHT_S_SUCCESS;
 }
 
 
-static starlight_status_t build_tree(
-    uint8_t *code_lengths, uint16_t alen, TreeTable *tree
+/*
+ * build a canonical huffman decode table. codes up to table->bits long
+ * are replicated across the primary table, longer codes go into
+ * subtables that are sized the same way zlib's inflate_table() does.
+ * incomplete codes are allowed, the unused entries decode as invalid.
+ */
+static starlight_status_t build_table(
+    const uint8_t *code_lengths, uint16_t alen,
+    uint32_t (*symbol_entry)(uint16_t symbol), HuffTable *table
 ) {
-    uint16_t length_frequency[16];
+    uint16_t length_frequency[MAX_CODE_LENGTH + 1];
+    uint16_t offsets[MAX_CODE_LENGTH + 1];
+    uint16_t sorted[288];
+
     memset(length_frequency, 0, sizeof(length_frequency));
 
-    // log("alen: %d", alen);
+    for (uint16_t i = 0; i < alen; i++) {
+        length_frequency[code_lengths[i]]++;
+    }
+
+    length_frequency[0] = 0;
+
+    // reject over-subscribed codes
+    int32_t left = 1;
+    uint8_t max = 0;
+    for (uint8_t len = 1; len <= MAX_CODE_LENGTH; len++) {
+        left = (left << 1) - length_frequency[len];
+        if (left < 0) return STARLIGHT_S_CORRUPT_DATA;
+        if (length_frequency[len]) max = len;
+    }
 
-    tree->max = 0;
-    tree->min = 100;
-    // uint8_t min_length = 128;
-    // uint8_t max_length = 0;
+    // sort the symbols by code length, then by value
+    offsets[1] = 0;
+    for (uint8_t len = 1; len < MAX_CODE_LENGTH; len++) {
+        offsets[len + 1] = offsets[len] + length_frequency[len];
+    }
 
     for (uint16_t i = 0; i < alen; i++) {
-        uint8_t code_length = code_lengths[i];
-        if (!code_length) continue;
-        ++length_frequency[code_length];
+        if (code_lengths[i]) sorted[offsets[code_lengths[i]]++] = i;
+    }
 
-        if (code_length > tree->max) {
-            tree->max = code_length;
-        }
-        if (code_length < tree->min) {
-            tree->min = code_length;
-        }
+    uint8_t bits = table->bits;
+    uint32_t *entries = table->entries;
+    const uint32_t invalid = HUFF_ENTRY(0, HUFF_INVALID, 0, 0);
+
+    for (uint16_t i = 0; i < (1 << bits); i++) {
+        entries[i] = invalid;
     }
 
-    length_frequency[0] = 0;
+    log("max: %d", max);
 
     uint16_t code = 0;
-    uint16_t codes[16];
-
-    log("min: %d - max: %d", tree->min, tree->max);
+    uint16_t next = 1 << bits; // next free subtable slot
+    uint16_t sub_prefix = 0xffff;
+    uint16_t sub_start = 0;
+    uint8_t sub_bits = 0;
+    uint16_t si = 0;
+
+    for (uint8_t len = 1; len <= max; len++, code <<= 1) {
+        for (; length_frequency[len]; length_frequency[len]--, code++) {
+            uint32_t entry = symbol_entry(sorted[si++]);
+            uint16_t reversed = starlight_reverse_bits(code, len);
+
+            if (len <= bits) {
+                entry |= len;
+                for (
+                    uint16_t idx = reversed; idx < (1 << bits); idx += 1 << len
+                ) entries[idx] = entry;
+                continue;
+            }
 
-    for (uint8_t i = 1; i < tree->max + 1; i++) {
-        code = (code + length_frequency[i-1]) << 1;
-        codes[i] = code;
-    }
+            uint16_t prefix = reversed & ((1 << bits) - 1);
+            if (prefix != sub_prefix) {
+                // size the subtable to hold every remaining code that
+                // shares this prefix
+                sub_bits = len - bits;
+                left = 1 << sub_bits;
+                while (sub_bits + bits < max) {
+                    left -= length_frequency[sub_bits + bits];
+                    if (left <= 0) break;
+                    sub_bits++;
+                    left <<= 1;
+                }
 
-    // TreeNode *node;
+                if (next + (1 << sub_bits) > HUFF_TABLE_SIZE)
+                    return STARLIGHT_S_CORRUPT_DATA;
 
-    // root->value = -1;
-    // root->left = NULL;
-    // root->right = NULL;
+                for (uint16_t i = 0; i < (1 << sub_bits); i++) {
+                    entries[next + i] = invalid;
+                }
 
-    // TreeTable tree;
-    memset(tree->table, -1, sizeof(tree->table));
+                entries[prefix] = HUFF_ENTRY(
+                    next, HUFF_SUBTABLE, sub_bits, bits
+                );
+                sub_prefix = prefix;
+                sub_start = next;
+                next += 1 << sub_bits;
+            }
 
-    for (uint16_t i = 0; i < alen; i++) {
-        uint8_t code_length = code_lengths[i];
-        if (!code_length) continue;
-
-        // node = root;
-        code = codes[code_length];
-        // uint16_t idx = code << (15 - code_length);
-        uint16_t idx = code | (1 << code_length);
-        // log(
-        //     "code len: %d, code: %d, idx: %d, sym: %d",
-        //     code_length, code, idx, i
-        // );
-        tree->table[idx] = i;
-        codes[code_length]++;
-
-
-        // log(
-        //     "[%2d] code: \33[93m%5d\33[m -> \33[32m%3d\33[m",
-        //     code_length, code, i
-        // );
-
-        // printf("[%2d] code: \33[93m%5d\33[m 0b1", code_length, code);
-
-        // for (int8_t j = code_length - 1; j > -1; j--) {
-            // node->value = -1;
-
-            // printf("%d", !!(code & (1 << j)));
-
-            // if (code & (1 << j)) {
-            //     if (node->right == NULL) {
-            //         node->right = malloc(sizeof(TreeNode));
-            //         if (node->right == NULL) return STARLIGHT_S_MALLOC_FAILED;
-            //
-            //         node->right->right = NULL;
-            //         node->right->left = NULL;
-            //         node->right->value = -1;
-            //     }
-            //     node = node->right;
-            // } else {
-            //     if (node->left == NULL) {
-            //         node->left = malloc(sizeof(TreeNode));
-            //         if (node->left == NULL) return STARLIGHT_S_MALLOC_FAILED;
-            //
-            //         node->left->right = NULL;
-            //         node->left->left = NULL;
-            //         node->left->value = -1;
-            //     }
-            //     node = node->left;
-            // }
-        // }
-        // printf("\33[95m");
-        // for (uint8_t j = 0; j < (15 - code_length); j++) {
-        //     putchar(' ');
-        // }
-
-        // uint16_t idx = code << (15 - code_length);
-        // assert(tree.table[idx] == -1);
-        // tree.table[idx] = i;
-        // printf(" \33[93m%5d ", idx);
-        // printf("\33[m -> \33[32m%3d\33[m\n", i);
-
-        // node->value = (int32_t)i;
-        // codes[code_length]++;
+            entry |= len - bits;
+            for (
+                uint16_t idx = reversed >> bits;
+                idx < (1 << sub_bits);
+                idx += 1 << (len - bits)
+            ) entries[sub_start + idx] = entry;
+        }
     }
 
     return STARLIGHT_S_SUCCESS;
@@ -428,61 +962,179 @@ static starlight_status_t build_tree(
 
 
 
-static starlight_status_t parse_data(
-    StarlightBuffer *input, StarlightBuffer *output,
-    TreeTable *ll_tree, TreeTable *dist_tree
+/*
+ * lz77 back-reference copy. while there is COPY_SLACK bytes of room past
+ * the match, copy whole words and let the last store overshoot; the
+ * overshoot is rewritten by whatever comes next. short distances are
+ * handled by splatting the repeating pattern into a word.
+ */
+#define COPY_SLACK 32
+
+static inline uint8_t *copy_match(
+    uint8_t *dst, uint8_t *end, uint32_t dist, uint16_t len
 ) {
-    // TreeNode *node;
-    int32_t symbol = -1;
+    const uint8_t *src = dst - dist;
+    uint8_t *stop = dst + len;
+
+    if (end - dst < len + COPY_SLACK) {
+        while (dst < stop) *dst++ = *src++;
+        return stop;
+    }
+
+    if (dist >= 32) {
+        do {
+            memcpy(dst, src, 32);
+            dst += 32; src += 32;
+        } while (dst < stop);
+    } else if (dist >= 16) {
+        do {
+            memcpy(dst, src, 16);
+            dst += 16; src += 16;
+        } while (dst < stop);
+    } else if (dist >= 8) {
+        do {
+            memcpy(dst, src, 8);
+            dst += 8; src += 8;
+        } while (dst < stop);
+    } else if (dist == 1) {
+        uint64_t pattern = 0x0101010101010101ull * *src;
+        do {
+            memcpy(dst, &pattern, 8);
+            dst += 8;
+        } while (dst < stop);
+    } else {
+        // repeat the first `dist` bytes across a word, then advance by
+        // the largest multiple of dist that fits so the pattern stays
+        // in phase
+        uint8_t pattern[8];
+        for (uint8_t i = 0; i < 8; i++) pattern[i] = src[i % dist];
+
+        uint8_t step = 8 - 8 % dist;
+        do {
+            memcpy(dst, pattern, 8);
+            dst += step;
+        } while (dst < stop);
+    }
+
+    return stop;
+}
+
+
+/*
+ * the hot loop runs without bounds checks while a whole literal/length
+ * and distance pair fits in one refill from whole input words, and the
+ * longest match plus its copy overshoot fits in the output. otherwise a
+ * single symbol is decoded with every check in place, which also carries
+ * the reader across input segment boundaries, and the hot loop resumes.
+ * a symbol that runs past the end of a partial input or a windowed
+ * output is rolled back, so the block can be resumed from it later.
+ */
+#define FAST_INPUT_MARGIN 8
+#define FAST_OUTPUT_MARGIN (258 + COPY_SLACK)
+
+static starlight_status_t parse_data(Inflater *z, StarlightBuffer *output) {
+    BitReader *input = &z->br;
+    const HuffTable *ll_table = z->ll_table;
+    const HuffTable *dist_table = z->dist_table;
+    uint8_t *o = output->c;
 
     while (true) {
-        if ((symbol = read_node(input, ll_tree)) == -1)
-            return STARLIGHT_S_CORRUPT_DATA;
+        while (
+            input->e - input->c >= FAST_INPUT_MARGIN &&
+            output->e - o >= FAST_OUTPUT_MARGIN
+        ) {
+            // 56 bits covers code + extra for length (20) and distance (28)
+            refill_fast(input);
+
+            uint32_t entry = lookup_entry(input, ll_table);
+            if (entry & HUFF_LITERAL) {
+                *o++ = (uint8_t)HUFF_VALUE(entry);
+                continue;
+            }
+
+            if (entry & HUFF_END) {
+                output->c = o;
+                return STARLIGHT_S_SUCCESS;
+            }
+
+            if (entry & HUFF_INVALID)
+                return STARLIGHT_S_CORRUPT_DATA;
+
+            uint16_t len = HUFF_VALUE(entry);
+            len += peek_bits(input, HUFF_EXTRA(entry));
+            consume_bits(input, HUFF_EXTRA(entry));
 
-        // symbol = node->value;
-        if (symbol < 0 || symbol > 288) return STARLIGHT_S_CORRUPT_DATA;
+            entry = lookup_entry(input, dist_table);
+            if (entry & HUFF_INVALID)
+                return STARLIGHT_S_CORRUPT_DATA;
+
+            uint32_t dist = HUFF_VALUE(entry);
+            dist += peek_bits(input, HUFF_EXTRA(entry));
+            consume_bits(input, HUFF_EXTRA(entry));
+
+            if (dist > o - output->s)
+                return STARLIGHT_S_CORRUPT_DATA;
 
-        if (symbol < 256) {
-            *output->c++ = (uint8_t)symbol;
-        } else if (symbol == 256) {
+            o = copy_match(o, output->e, dist, len);
+        }
+
+        BitReader checkpoint = *input;
+        starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+        uint32_t entry = decode_entry(input, ll_table);
+        if (overran(input)) {
+            status = STARLIGHT_S_CORRUPT_DATA;
+        } else if (entry & HUFF_LITERAL) {
+            if (o < output->e) {
+                *o++ = (uint8_t)HUFF_VALUE(entry);
+                continue;
+            }
+
+            status = INFLATE_NEED_OUTPUT;
+        } else if (entry & HUFF_END) {
             break;
+        } else if (entry & HUFF_INVALID) {
+            return STARLIGHT_S_CORRUPT_DATA;
         } else {
-            symbol -= 257;
-            uint16_t len = LENGTH_BASE[symbol];
-
-            if (LENGTH_EXTRA[symbol]) {
-                len += read_bits_be(input, LENGTH_EXTRA[symbol]);
+            uint16_t len = HUFF_VALUE(entry);
+            if (HUFF_EXTRA(entry)) {
+                len += read_bits(input, HUFF_EXTRA(entry));
             }
 
-            if ((symbol = read_node(input, dist_tree)) == -1)
-                return STARLIGHT_S_CORRUPT_DATA;
+            entry = decode_entry(input, dist_table);
 
-            // symbol = node->value;
-            if (symbol < 0 || symbol > 30) return STARLIGHT_S_CORRUPT_DATA;
-            
-            uint32_t dist = DIST_BASE[symbol];
-            if (DIST_EXTRA[symbol]) {
-                dist += read_bits_be(input, DIST_EXTRA[symbol]);
+            uint32_t dist = HUFF_VALUE(entry);
+            if (HUFF_EXTRA(entry)) {
+                dist += read_bits(input, HUFF_EXTRA(entry));
             }
 
-            uint8_t *p = output->c - dist;
-            if (dist == 1) {
-                uint8_t v = *p;
-                if (len) {
-                    do {
-                        *output->c++ = v;
-                    } while (--len);
-                }
+            if (overran(input)) {
+                status = STARLIGHT_S_CORRUPT_DATA;
+            } else if (entry & HUFF_INVALID || dist > o - output->s) {
+                return STARLIGHT_S_CORRUPT_DATA;
+            } else if (len > output->e - o) {
+                status = INFLATE_NEED_OUTPUT;
             } else {
-                if (len) {
-                    do {
-                        *output->c++ = *p++;
-                    } while (--len);
-                }
+                o = copy_match(o, output->e, dist, len);
+                continue;
             }
         }
+
+        output->c = o;
+
+        if (status == STARLIGHT_S_CORRUPT_DATA && z->partial) {
+            *input = checkpoint;
+            return INFLATE_NEED_INPUT;
+        }
+
+        if (status == INFLATE_NEED_OUTPUT) {
+            if (!z->windowed) return STARLIGHT_S_CORRUPT_DATA;
+            *input = checkpoint;
+        }
+
+        return status;
     }
 
+    output->c = o;
     return STARLIGHT_S_SUCCESS;
 }
-
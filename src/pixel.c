@@ -0,0 +1,642 @@
+#include "starlight.h"
+
+#include <threads.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * pixel format conversion of whole rows. these are pure byte shuffles,
+ * apart from premultiplication, so the vector kernels move a register per
+ * step and leave what is left over to the scalar loops, which are also
+ * what every other target runs. dst and src must not overlap.
+ */
+typedef void (*PixelKernel)(uint8_t *dst, const uint8_t *src, uint64_t count);
+
+static void rgb8_scalar(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++, src += 3, dst += 4) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 255;
+    }
+}
+
+static void bgr8_scalar(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++, src += 3, dst += 4) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = 255;
+    }
+}
+
+static void swap_rb8_scalar(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    for (uint64_t i = 0; i < count; i++, src += 4, dst += 4) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = src[3];
+    }
+}
+
+static void strip_alpha8_scalar(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    for (uint64_t i = 0; i < count; i++, src += 4, dst += 3) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+    }
+}
+
+// c * a / 255, rounded to nearest, for any c and a up to 255
+static inline uint8_t mul_div255(uint32_t c, uint32_t a) {
+    uint32_t x = c * a + 128;
+    return (uint8_t)((x + (x >> 8)) >> 8);
+}
+
+static void premultiply8_scalar(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    for (uint64_t i = 0; i < count; i++, src += 4, dst += 4) {
+        uint8_t a = src[3];
+        dst[0] = mul_div255(src[0], a);
+        dst[1] = mul_div255(src[1], a);
+        dst[2] = mul_div255(src[2], a);
+        dst[3] = a;
+    }
+}
+
+static void widen8_scalar(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++, dst += 2) dst[0] = dst[1] = src[i];
+}
+
+static void g8_scalar(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++, dst += 4) {
+        dst[0] = dst[1] = dst[2] = src[i];
+        dst[3] = 255;
+    }
+}
+
+static void ga8_scalar(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++, src += 2, dst += 4) {
+        dst[0] = dst[1] = dst[2] = src[0];
+        dst[3] = src[1];
+    }
+}
+
+// png samples are big endian, keep the high byte
+static void narrow16_scalar(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    for (uint64_t i = 0; i < count; i++) dst[i] = src[i * 2];
+}
+
+typedef void (*PaletteKernel)(
+    uint8_t *dst, const uint8_t *src, uint64_t count, const uint8_t *palette
+);
+
+static void palette_scalar(
+    uint8_t *dst, const uint8_t *src, uint64_t count, const uint8_t *palette
+) {
+    for (uint64_t i = 0; i < count; i++, dst += 4) {
+        memcpy(dst, palette + src[i] * 4, 4);
+    }
+}
+
+/*
+ * 1, 2 and 4 bit samples are packed most significant first. they are
+ * unpacked a byte at a time through a table per depth, whose entries
+ * hold the 8, 4 or 2 samples of that byte, as they are or scaled up to
+ * the full 0..255 range.
+ */
+static uint8_t UNPACK1[2][256][8];
+static uint8_t UNPACK2[2][256][4];
+static uint8_t UNPACK4[2][256][2];
+
+static void build_unpack_table(uint8_t *table, uint8_t depth, bool scale) {
+    uint8_t per_byte = 8 / depth;
+    uint8_t mask = (1 << depth) - 1;
+
+    for (uint32_t b = 0; b < 256; b++) {
+        for (uint8_t k = 0; k < per_byte; k++) {
+            uint8_t v = (b >> (8 - depth * (k + 1))) & mask;
+            *table++ = scale ? v * (255 / mask) : v;
+        }
+    }
+}
+
+
+#if defined(__x86_64__)
+// 4 pixels a step, from a 16 byte load of which 12 are used
+__attribute__((target("ssse3")))
+static inline uint64_t spread3_ssse3(
+    uint8_t *dst, const uint8_t *src, uint64_t count, __m128i spread
+) {
+    const __m128i alpha = _mm_set1_epi32((int32_t)0xFF000000);
+
+    uint64_t i = 0;
+    for (; i + 6 <= count; i += 4, src += 12, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        v = _mm_or_si128(_mm_shuffle_epi8(v, spread), alpha);
+        _mm_storeu_si128((__m128i *)dst, v);
+    }
+
+    return i;
+}
+
+// 8 pixels a step, 4 in each lane
+__attribute__((target("avx2")))
+static inline uint64_t spread3_avx2(
+    uint8_t *dst, const uint8_t *src, uint64_t count, __m128i spread
+) {
+    const __m256i spread2 = _mm256_broadcastsi128_si256(spread);
+    const __m256i alpha = _mm256_set1_epi32((int32_t)0xFF000000);
+
+    uint64_t i = 0;
+    for (; i + 10 <= count; i += 8, src += 24, dst += 32) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+            _mm_loadu_si128((const __m128i *)(src + 12)), 1
+        );
+        v = _mm256_or_si256(_mm256_shuffle_epi8(v, spread2), alpha);
+        _mm256_storeu_si256((__m256i *)dst, v);
+    }
+
+    return i;
+}
+
+#define RGB_SPREAD _mm_setr_epi8(\
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1\
+)
+#define BGR_SPREAD _mm_setr_epi8(\
+    2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1\
+)
+
+__attribute__((target("ssse3")))
+static void rgb8_ssse3(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = spread3_ssse3(dst, src, count, RGB_SPREAD);
+    rgb8_scalar(dst + i * 4, src + i * 3, count - i);
+}
+
+__attribute__((target("avx2")))
+static void rgb8_avx2(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = spread3_avx2(dst, src, count, RGB_SPREAD);
+    rgb8_scalar(dst + i * 4, src + i * 3, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void bgr8_ssse3(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = spread3_ssse3(dst, src, count, BGR_SPREAD);
+    bgr8_scalar(dst + i * 4, src + i * 3, count - i);
+}
+
+__attribute__((target("avx2")))
+static void bgr8_avx2(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = spread3_avx2(dst, src, count, BGR_SPREAD);
+    bgr8_scalar(dst + i * 4, src + i * 3, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void swap_rb8_ssse3(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    const __m128i swap = _mm_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+    );
+
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4, src += 16, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, swap));
+    }
+
+    swap_rb8_scalar(dst, src, count - i);
+}
+
+// 4 pixels a step, into a 16 byte store of which 12 are kept
+__attribute__((target("ssse3")))
+static void strip_alpha8_ssse3(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    const __m128i pack = _mm_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+    );
+
+    uint64_t i = 0;
+    for (; i + 6 <= count; i += 4, src += 16, dst += 12) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, pack));
+    }
+
+    strip_alpha8_scalar(dst, src, count - i);
+}
+
+static void premultiply8_sse2(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i alpha = _mm_set1_epi32((int32_t)0xFF000000);
+
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4, src += 16, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+        // alpha of each pixel in all four of its lanes
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+
+        // the same rounding as mul_div255
+        lo = _mm_add_epi16(_mm_mullo_epi16(lo, a_lo), half);
+        hi = _mm_add_epi16(_mm_mullo_epi16(hi, a_hi), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+        __m128i p = _mm_packus_epi16(lo, hi);
+        p = _mm_or_si128(_mm_andnot_si128(alpha, p), _mm_and_si128(alpha, v));
+        _mm_storeu_si128((__m128i *)dst, p);
+    }
+
+    premultiply8_scalar(dst, src, count - i);
+}
+
+static void widen8_sse2(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 16, dst += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i *o = (__m128i *)dst;
+        _mm_storeu_si128(o + 0, _mm_unpacklo_epi8(v, v));
+        _mm_storeu_si128(o + 1, _mm_unpackhi_epi8(v, v));
+    }
+
+    widen8_scalar(dst, src, count - i);
+}
+
+static void g8_sse2(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    const __m128i opaque = _mm_set1_epi8((char)0xFF);
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 16, dst += 64) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+        __m128i gg_lo = _mm_unpacklo_epi8(v, v);
+        __m128i gg_hi = _mm_unpackhi_epi8(v, v);
+        __m128i ga_lo = _mm_unpacklo_epi8(v, opaque);
+        __m128i ga_hi = _mm_unpackhi_epi8(v, opaque);
+
+        __m128i *o = (__m128i *)dst;
+        _mm_storeu_si128(o + 0, _mm_unpacklo_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(gg_hi, ga_hi));
+        _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(gg_hi, ga_hi));
+    }
+
+    g8_scalar(dst, src, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void ga8_ssse3(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    const __m128i spread_lo = _mm_setr_epi8(
+        0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7
+    );
+    const __m128i spread_hi = _mm_setr_epi8(
+        8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15
+    );
+
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8, src += 16, dst += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i *o = (__m128i *)dst;
+        _mm_storeu_si128(o + 0, _mm_shuffle_epi8(v, spread_lo));
+        _mm_storeu_si128(o + 1, _mm_shuffle_epi8(v, spread_hi));
+    }
+
+    ga8_scalar(dst, src, count - i);
+}
+
+static void narrow16_sse2(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    const __m128i high = _mm_set1_epi16(0x00FF);
+
+    // the high byte of a big endian sample is the low byte of a lane
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 32, dst += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        a = _mm_and_si128(a, high);
+        b = _mm_and_si128(b, high);
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(a, b));
+    }
+
+    narrow16_scalar(dst, src, count - i);
+}
+
+// 8 pixels a step, each one a 4 byte gather from the palette
+__attribute__((target("avx2")))
+static void palette_avx2(
+    uint8_t *dst, const uint8_t *src, uint64_t count, const uint8_t *palette
+) {
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8, src += 8, dst += 32) {
+        __m256i index = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)src)
+        );
+        __m256i v = _mm256_i32gather_epi32((const int *)palette, index, 4);
+        _mm256_storeu_si256((__m256i *)dst, v);
+    }
+
+    palette_scalar(dst, src, count - i, palette);
+}
+#endif
+
+
+#if defined(__ARM_NEON)
+static void rgb8_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 48, dst += 64) {
+        uint8x16x3_t rgb = vld3q_u8(src);
+        uint8x16x4_t rgba = {{
+            rgb.val[0], rgb.val[1], rgb.val[2], vdupq_n_u8(255)
+        }};
+        vst4q_u8(dst, rgba);
+    }
+
+    rgb8_scalar(dst, src, count - i);
+}
+
+static void bgr8_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 48, dst += 64) {
+        uint8x16x3_t rgb = vld3q_u8(src);
+        uint8x16x4_t bgra = {{
+            rgb.val[2], rgb.val[1], rgb.val[0], vdupq_n_u8(255)
+        }};
+        vst4q_u8(dst, bgra);
+    }
+
+    bgr8_scalar(dst, src, count - i);
+}
+
+static void swap_rb8_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 64, dst += 64) {
+        uint8x16x4_t v = vld4q_u8(src);
+        uint8x16_t r = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = r;
+        vst4q_u8(dst, v);
+    }
+
+    swap_rb8_scalar(dst, src, count - i);
+}
+
+static void strip_alpha8_neon(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 64, dst += 48) {
+        uint8x16x4_t v = vld4q_u8(src);
+        uint8x16x3_t rgb = {{ v.val[0], v.val[1], v.val[2] }};
+        vst3q_u8(dst, rgb);
+    }
+
+    strip_alpha8_scalar(dst, src, count - i);
+}
+
+static inline uint8x8_t mul_div255_neon(uint8x8_t c, uint8x8_t a) {
+    uint16x8_t x = vmlal_u8(vdupq_n_u16(128), c, a);
+    return vshrn_n_u16(vsraq_n_u16(x, x, 8), 8);
+}
+
+static void premultiply8_neon(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8, src += 32, dst += 32) {
+        uint8x8x4_t v = vld4_u8(src);
+        v.val[0] = mul_div255_neon(v.val[0], v.val[3]);
+        v.val[1] = mul_div255_neon(v.val[1], v.val[3]);
+        v.val[2] = mul_div255_neon(v.val[2], v.val[3]);
+        vst4_u8(dst, v);
+    }
+
+    premultiply8_scalar(dst, src, count - i);
+}
+
+static void widen8_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 16, dst += 32) {
+        uint8x16_t v = vld1q_u8(src);
+        uint8x16x2_t w = {{ v, v }};
+        vst2q_u8(dst, w);
+    }
+
+    widen8_scalar(dst, src, count - i);
+}
+
+static void g8_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 16, dst += 64) {
+        uint8x16_t g = vld1q_u8(src);
+        uint8x16x4_t rgba = {{ g, g, g, vdupq_n_u8(255) }};
+        vst4q_u8(dst, rgba);
+    }
+
+    g8_scalar(dst, src, count - i);
+}
+
+static void ga8_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 32, dst += 64) {
+        uint8x16x2_t ga = vld2q_u8(src);
+        uint8x16x4_t rgba = {{ ga.val[0], ga.val[0], ga.val[0], ga.val[1] }};
+        vst4q_u8(dst, rgba);
+    }
+
+    ga8_scalar(dst, src, count - i);
+}
+
+static void narrow16_neon(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 32, dst += 16) {
+        vst1q_u8(dst, vld2q_u8(src).val[0]);
+    }
+
+    narrow16_scalar(dst, src, count - i);
+}
+#endif
+
+
+static PixelKernel RGB8_KERNEL;
+static PixelKernel G8_KERNEL;
+static PixelKernel GA8_KERNEL;
+static PixelKernel NARROW16_KERNEL;
+static PixelKernel BGR8_KERNEL;
+static PixelKernel SWAP_RB8_KERNEL;
+static PixelKernel STRIP_ALPHA8_KERNEL;
+static PixelKernel PREMULTIPLY8_KERNEL;
+static PixelKernel WIDEN8_KERNEL;
+static PaletteKernel PALETTE_KERNEL;
+static once_flag PIXEL_ONCE = ONCE_FLAG_INIT;
+
+static void pick_pixel_kernels(void) {
+    for (uint8_t scale = 0; scale < 2; scale++) {
+        build_unpack_table(&UNPACK1[scale][0][0], 1, scale);
+        build_unpack_table(&UNPACK2[scale][0][0], 2, scale);
+        build_unpack_table(&UNPACK4[scale][0][0], 4, scale);
+    }
+
+    RGB8_KERNEL = rgb8_scalar;
+    G8_KERNEL = g8_scalar;
+    GA8_KERNEL = ga8_scalar;
+    NARROW16_KERNEL = narrow16_scalar;
+    BGR8_KERNEL = bgr8_scalar;
+    SWAP_RB8_KERNEL = swap_rb8_scalar;
+    STRIP_ALPHA8_KERNEL = strip_alpha8_scalar;
+    PREMULTIPLY8_KERNEL = premultiply8_scalar;
+    WIDEN8_KERNEL = widen8_scalar;
+    PALETTE_KERNEL = palette_scalar;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    G8_KERNEL = g8_sse2;
+    NARROW16_KERNEL = narrow16_sse2;
+    PREMULTIPLY8_KERNEL = premultiply8_sse2;
+    WIDEN8_KERNEL = widen8_sse2;
+
+    if (__builtin_cpu_supports("ssse3")) {
+        RGB8_KERNEL = rgb8_ssse3;
+        GA8_KERNEL = ga8_ssse3;
+        BGR8_KERNEL = bgr8_ssse3;
+        SWAP_RB8_KERNEL = swap_rb8_ssse3;
+        STRIP_ALPHA8_KERNEL = strip_alpha8_ssse3;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        RGB8_KERNEL = rgb8_avx2;
+        BGR8_KERNEL = bgr8_avx2;
+        PALETTE_KERNEL = palette_avx2;
+    }
+#endif
+
+#if defined(__ARM_NEON)
+    RGB8_KERNEL = rgb8_neon;
+    G8_KERNEL = g8_neon;
+    GA8_KERNEL = ga8_neon;
+    NARROW16_KERNEL = narrow16_neon;
+    BGR8_KERNEL = bgr8_neon;
+    SWAP_RB8_KERNEL = swap_rb8_neon;
+    STRIP_ALPHA8_KERNEL = strip_alpha8_neon;
+    PREMULTIPLY8_KERNEL = premultiply8_neon;
+    WIDEN8_KERNEL = widen8_neon;
+#endif
+}
+
+void starlight_expand_rgb8(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    RGB8_KERNEL(dst, src, count);
+}
+
+void starlight_expand_g8(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    G8_KERNEL(dst, src, count);
+}
+
+void starlight_expand_ga8(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    GA8_KERNEL(dst, src, count);
+}
+
+void starlight_narrow_16(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    NARROW16_KERNEL(dst, src, count);
+}
+
+void starlight_expand_bgr8(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    BGR8_KERNEL(dst, src, count);
+}
+
+void starlight_swap_rb8(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    SWAP_RB8_KERNEL(dst, src, count);
+}
+
+void starlight_strip_alpha8(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    STRIP_ALPHA8_KERNEL(dst, src, count);
+}
+
+void starlight_premultiply8(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    PREMULTIPLY8_KERNEL(dst, src, count);
+}
+
+void starlight_widen_8(uint8_t *dst, const uint8_t *src, uint64_t count) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    WIDEN8_KERNEL(dst, src, count);
+}
+
+void starlight_expand_palette(
+    uint8_t *dst, const uint8_t *src, uint64_t count, const uint8_t *palette
+) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+    PALETTE_KERNEL(dst, src, count, palette);
+}
+
+void starlight_unpack_bits(
+    uint8_t *dst, const uint8_t *src, uint64_t count, uint8_t depth,
+    bool scale
+) {
+    call_once(&PIXEL_ONCE, pick_pixel_kernels);
+
+    uint8_t per_byte = 8 / depth;
+    uint64_t whole = count / per_byte;
+    uint8_t rest = count % per_byte;
+    uint8_t last[8];
+
+    switch (depth) {
+        case 1:
+            for (uint64_t i = 0; i < whole; i++, dst += 8) {
+                memcpy(dst, UNPACK1[scale][src[i]], 8);
+            }
+            if (rest) memcpy(last, UNPACK1[scale][src[whole]], 8);
+        break;
+
+        case 2:
+            for (uint64_t i = 0; i < whole; i++, dst += 4) {
+                memcpy(dst, UNPACK2[scale][src[i]], 4);
+            }
+            if (rest) memcpy(last, UNPACK2[scale][src[whole]], 4);
+        break;
+
+        case 4:
+            for (uint64_t i = 0; i < whole; i++, dst += 2) {
+                memcpy(dst, UNPACK4[scale][src[i]], 2);
+            }
+            if (rest) memcpy(last, UNPACK4[scale][src[whole]], 2);
+        break;
+
+        default:
+            memcpy(dst, src, count);
+            return;
+    }
+
+    // the padding bits of the last byte are not samples
+    if (rest) memcpy(dst, last, rest);
+}
@@ -2,52 +2,211 @@
 #include "starlight.h"
 
 #include <stdlib.h>
+
+#ifdef STARLIGHT_STATS
 #include <time.h>
+#endif
+
+static starlight_status_t reconstruct(
+    Starlight *starlight, const StarlightBuffer *filtered
+);
+static starlight_status_t decode(Starlight *starlight);
+static starlight_status_t decode_rows(Starlight *starlight);
+
+/*
+ * stage timers for starlight->stats, gone unless STARLIGHT_STATS is
+ * defined. a timer also notes the time the stages have taken so far, so
+ * the stages run while it is going are taken back out at the stop.
+ */
+#ifdef STARLIGHT_STATS
+typedef struct StatsTimer {
+    uint64_t start;
+    uint64_t nested;
+} StatsTimer;
+
+static uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t stats_total(StarlightStats *stats) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < STARLIGHT_T_LENGTH; i++) total += stats->ns[i];
+    return total;
+}
 
-static starlight_status_t reconstruct(Starlight *starlight);
+static StatsTimer stats_start(Starlight *starlight) {
+    if (starlight->stats == NULL) return (StatsTimer) { 0, 0 };
+    return (StatsTimer) {
+        .start = stats_clock(), .nested = stats_total(starlight->stats),
+    };
+}
+
+static void stats_stop(
+    Starlight *starlight, starlight_stage_t stage,
+    StatsTimer timer, uint64_t bytes
+) {
+    StarlightStats *stats = starlight->stats;
+    if (stats == NULL) return;
+
+    uint64_t nested = stats_total(stats) - timer.nested;
+    stats->count[stage]++;
+    stats->ns[stage] += stats_clock() - timer.start - nested;
+    stats->bytes[stage] += bytes;
+}
 
-static uint32_t starlight_abs(int32_t value) {
-    return value < 0 ? -value : value;
+// bytes a stage went through, counted apart from its timer
+static void stats_bytes(
+    Starlight *starlight, starlight_stage_t stage, uint64_t bytes
+) {
+    if (starlight->stats != NULL) starlight->stats->bytes[stage] += bytes;
 }
 
+#define STATS_START(starlight, timer) \
+    StatsTimer timer = stats_start(starlight)
+#define STATS_STOP(starlight, stage, timer, bytes) \
+    stats_stop(starlight, stage, timer, bytes)
+#define STATS_BYTES(starlight, stage, bytes) \
+    stats_bytes(starlight, stage, bytes)
+#else
+#define STATS_START(starlight, timer)
+#define STATS_STOP(starlight, stage, timer, bytes)
+#define STATS_BYTES(starlight, stage, bytes)
+#endif
+
+static const uint8_t PNG_SIGNATURE[8] = {
+    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
 static uint32_t u32_be(StarlightBuffer *buffer) {
     uint8_t a = *buffer->c++;
     uint8_t b = *buffer->c++;
     uint8_t c = *buffer->c++;
     uint8_t d = *buffer->c++;
-    return (a << 24) + (b << 16) + (c << 8) + (d);
+    return ((uint32_t)a << 24) + (b << 16) + (c << 8) + (d);
 }
 
-bool starlight_png_check(Starlight *starlight) {
-    starlight->raw.c = starlight->raw.s + 8;
+static starlight_status_t add_idat(
+    Starlight *starlight, uint8_t *data, uint32_t length
+) {
+    StarlightPngDetail *png = &starlight->png;
+
+    if (png->idat_count == png->idat_capacity) {
+        uint32_t capacity = png->idat_capacity ? png->idat_capacity * 2 : 16;
+        StarlightScratch *scratch = starlight->scratch;
+        StarlightBuffer *idat = NULL;
+
+        if (scratch != NULL) {
+            idat = starlight_scratch_grow(
+                scratch, scratch->idat, &scratch->idat_length,
+                capacity * sizeof(StarlightBuffer)
+            );
+            if (idat != NULL) scratch->idat = idat;
+        } else {
+            idat = realloc(png->idat, capacity * sizeof(StarlightBuffer));
+        }
+        if (idat == NULL) return STARLIGHT_S_MALLOC_FAILED;
 
-    return (
-        starlight->raw.s[0] == 0x89 &&
-        starlight->raw.s[1] == 0x50 &&
-        starlight->raw.s[2] == 0x4E &&
-        starlight->raw.s[3] == 0x47 &&
-        starlight->raw.s[4] == 0x0D &&
-        starlight->raw.s[5] == 0x0A &&
-        starlight->raw.s[6] == 0x1A &&
-        starlight->raw.s[7] == 0x0A
-    );
+        png->idat = idat;
+        png->idat_capacity = capacity;
+    }
+
+    png->idat[png->idat_count++] = (StarlightBuffer) {
+        .s = data, .c = data, .e = data + length, .l = length
+    };
+    return STARLIGHT_S_SUCCESS;
 }
 
-starlight_status_t starlight_png_load_header(Starlight *starlight) {
-    StarlightBuffer *input = &starlight->raw;
+// hands out the payloads of consecutive idat chunks straight from raw
+static bool next_idat(StarlightSource *source, StarlightBuffer *span) {
+    StarlightBuffer *input = source->data;
+    if (input->e - input->c < 12) return false;
 
+    uint8_t *chunk = input->c;
     uint32_t chunk_length = u32_be(input);
     uint32_t chunk_type = u32_be(input);
+    input->c = chunk;
 
-    if (chunk_length != 13 || chunk_type != 0x49484452) {
-        return STARLIGHT_S_CORRUPT_DATA;
+    // 8 byte length and type + chunk data + 4 byte crc
+    if (
+        chunk_type != 0x49444154 ||
+        (uint64_t)chunk_length + 12 > (uint64_t)(input->e - chunk)
+    ) return false;
+
+    span->s = chunk + 8;
+    span->l = chunk_length;
+    input->c = chunk + 12 + chunk_length;
+    return true;
+}
+
+// bytes of one unfiltered scanline `width` pixels wide
+static uint64_t scanline_bytes(Starlight *starlight, uint32_t width) {
+    uint64_t bits = (uint64_t)width * starlight->png.channels;
+    return (bits * starlight->png.bit_depth + 7) / 8;
+}
+
+// bits per pixel of the decoded output
+static uint32_t output_bits(Starlight *starlight) {
+    switch (starlight->pixel_format) {
+        case STARLIGHT_P_NATIVE:
+            return starlight->png.channels * starlight->png.bit_depth;
+        case STARLIGHT_P_RGB8:
+            return 24;
+        case STARLIGHT_P_RGBA16:
+            return 64;
+        default:
+            return 32;
+    }
+}
+
+// the bit depths each color type allows
+static bool valid_depth(uint8_t color_type, uint8_t bit_depth) {
+    switch (color_type) {
+        case 2:
+        case 4:
+        case 6:
+            return bit_depth == 8 || bit_depth == 16;
+
+        case 3:
+            return (
+                bit_depth == 8 || bit_depth == 4 ||
+                bit_depth == 2 || bit_depth == 1
+            );
+
+        case 0:
+            return (
+                bit_depth == 8 || bit_depth == 4 ||
+                bit_depth == 2 || bit_depth == 1 || bit_depth == 16
+            );
+
+        default:
+            return false;
     }
+}
+
+// channels and filter bytes per pixel of a valid color type and depth
+static void set_pixel_size(Starlight *starlight) {
+    static const uint8_t CHANNELS[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    StarlightPngDetail *png = &starlight->png;
+
+    png->channels = CHANNELS[png->color_type];
+    png->bpp = png->channels * png->bit_depth / 8;
+    if (png->bpp == 0) png->bpp = 1;
+}
 
+// the 13 byte ihdr chunk data at the cursor
+static starlight_status_t read_ihdr(
+    Starlight *starlight, StarlightBuffer *input
+) {
     starlight->format = STARLIGHT_F_PNG;
 
     starlight->width = u32_be(input);
     starlight->height = u32_be(input);
 
+    if (starlight->width == 0 || starlight->height == 0)
+        return STARLIGHT_S_CORRUPT_DATA;
+
     uint8_t bit_depth = *input->c++;
     uint8_t color_type = *input->c++;
 
@@ -58,94 +217,294 @@ starlight_status_t starlight_png_load_header(Starlight *starlight) {
     starlight->png.filter_method = *input->c++;
     starlight->png.interlace_method = *input->c++;
 
-    starlight->png.bpp = 4;
-    if (color_type == 2) {
-        starlight->png.bpp = 3;
+    if (!valid_depth(color_type, bit_depth))
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    set_pixel_size(starlight);
+
+    if (starlight->png.interlace_method > 1)
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    // no PLTE or tRNS yet
+    memset(starlight->png.palette, 0, sizeof(starlight->png.palette));
+    for (uint32_t i = 0; i < 256; i++) {
+        starlight->png.palette[i * 4 + 3] = 255;
     }
+    starlight->png.palette_count = 0;
+    starlight->png.has_trns = false;
+
+    starlight->output.x = 0;
+    starlight->output.y = 0;
+    starlight->output.width = starlight->width;
+    starlight->output.height = starlight->height;
 
-    if (color_type == 0 || color_type == 3 || color_type == 4)
+    if (starlight->pixel_format >= STARLIGHT_P_LENGTH)
         return STARLIGHT_S_NOT_IMPLEMENTED;
 
-    switch (color_type) {
-        case 2:
-        case 4:
-        case 6:
-            if (bit_depth != 8 && bit_depth != 16) {
-                return STARLIGHT_S_CORRUPT_DATA;
-            }
-        break;
+    uint64_t filtered = (uint64_t)starlight->height * (
+        1 + scanline_bytes(starlight, starlight->width)
+    );
+
+    starlight->output.stride = (
+        ((uint64_t)starlight->width * output_bits(starlight) + 7) / 8
+    );
+
+    // big enough for the filtered scanlines too, see decode(), which
+    // interlaced images never hold all at once
+    starlight->out.l = starlight->output.stride * starlight->height;
+    if (!starlight->png.interlace_method && starlight->out.l < filtered)
+        starlight->out.l = filtered;
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+static starlight_status_t read_plte(
+    Starlight *starlight, const uint8_t *data, uint32_t length
+) {
+    StarlightPngDetail *png = &starlight->png;
+    uint32_t count = length / 3;
+
+    // gray images must not have one, for rgb it is only a suggestion
+    if (png->color_type == 0 || png->color_type == 4)
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    if (length % 3 || count == 0 || count > 256)
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    if (png->color_type == 3 && count > (1u << png->bit_depth))
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(png->palette + i * 4, data + i * 3, 3);
+    }
+    png->palette_count = count;
+
+    return STARLIGHT_S_SUCCESS;
+}
 
+static starlight_status_t read_trns(
+    Starlight *starlight, const uint8_t *data, uint32_t length
+) {
+    StarlightPngDetail *png = &starlight->png;
+
+    switch (png->color_type) {
         case 3:
-            if (
-                bit_depth != 8 && bit_depth != 4 &&
-                bit_depth != 2 && bit_depth != 1
-            ) return STARLIGHT_S_CORRUPT_DATA;
+            if (png->palette_count == 0 || length > png->palette_count)
+                return STARLIGHT_S_CORRUPT_DATA;
+
+            for (uint32_t i = 0; i < length; i++) {
+                png->palette[i * 4 + 3] = data[i];
+            }
         break;
 
         case 0:
-            if (
-                bit_depth != 8 && bit_depth != 4 &&
-                bit_depth != 2 && bit_depth != 1 && bit_depth != 16
-            ) return STARLIGHT_S_CORRUPT_DATA;
+        case 2: {
+            if (length != png->channels * 2u)
+                return STARLIGHT_S_CORRUPT_DATA;
+
+            for (uint8_t i = 0; i < png->channels; i++) {
+                png->trns[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+            }
+            png->has_trns = true;
+        } break;
+
+        // images with an alpha channel have no use for it
+        default:
         break;
+    }
 
+    return STARLIGHT_S_SUCCESS;
+}
+
+// the chunks besides the image data that decoding depends on
+static starlight_status_t read_table(
+    Starlight *starlight, uint32_t chunk_type,
+    const uint8_t *data, uint32_t length
+) {
+    switch (chunk_type) {
+        case 0x504C5445: // PLTE
+            return read_plte(starlight, data, length);
+        case 0x74524E53: // tRNS
+            return read_trns(starlight, data, length);
         default:
-            return STARLIGHT_S_CORRUPT_DATA;
+            return STARLIGHT_S_SUCCESS;
     }
+}
 
-    // 17 = 4 byte chunk type + 13 byte chunk data
+bool starlight_png_check(Starlight *starlight) {
+    if (starlight->raw.l < 8) return false;
+    starlight->raw.c = starlight->raw.s + 8;
+
+    return (
+        starlight->raw.s[0] == 0x89 &&
+        starlight->raw.s[1] == 0x50 &&
+        starlight->raw.s[2] == 0x4E &&
+        starlight->raw.s[3] == 0x47 &&
+        starlight->raw.s[4] == 0x0D &&
+        starlight->raw.s[5] == 0x0A &&
+        starlight->raw.s[6] == 0x1A &&
+        starlight->raw.s[7] == 0x0A
+    );
+}
+
+static uint32_t load_u32_be(const uint8_t *data) {
+    return (
+        ((uint32_t)data[0] << 24) | (data[1] << 16) |
+        (data[2] << 8) | data[3]
+    );
+}
+
+starlight_status_t starlight_png_probe(
+    const uint8_t *data, uint64_t length, StarlightInfo *info
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    if (length < 8 || memcmp(data, PNG_SIGNATURE, 8))
+        return STARLIGHT_S_UNKNOWN_FORMAT;
+
+    // 8 byte signature + 8 byte length and type + 13 byte ihdr + 4 byte crc
     if (
-        starlight_calc_crc(input->c - 17, 17) !=
-        u32_be(input)
-    ) {
+        length < 33 || load_u32_be(data + 8) != 13 ||
+        load_u32_be(data + 12) != 0x49484452 ||
+        starlight_calc_crc(data + 12, 17) != load_u32_be(data + 29)
+    ) return STARLIGHT_S_CORRUPT_DATA;
+
+    // the loader's own checks, on a scratch decoder
+    Starlight starlight = { 0 };
+    StarlightBuffer input = {
+        .s = (uint8_t *)data, .c = (uint8_t *)data + 16,
+        .e = (uint8_t *)data + length, .l = length,
+    };
+    if ((status = read_ihdr(&starlight, &input))) return status;
+
+    info->format = STARLIGHT_F_PNG;
+    info->width = starlight.width;
+    info->height = starlight.height;
+    info->bit_depth = starlight.png.bit_depth;
+    info->color_type = starlight.png.color_type;
+    info->interlace_method = starlight.png.interlace_method;
+    info->channels = starlight.png.channels;
+
+    const uint8_t *chunk = data + 33;
+    const uint8_t *end = data + length;
+    if (info->scan < (uint64_t)(end - chunk)) end = chunk + info->scan;
+
+    // 4 byte length + 4 byte type + chunk data + 4 byte crc
+    while (end - chunk >= 8) {
+        uint32_t chunk_length = load_u32_be(chunk);
+        uint32_t chunk_type = load_u32_be(chunk + 4);
+
+        if (chunk_type == 0x49444154 || chunk_type == 0x49454E44) break;
+        if ((uint64_t)chunk_length + 12 > (uint64_t)(end - chunk)) break;
+
+        const uint8_t *chunk_data = chunk + 8;
+        switch (chunk_type) {
+            case 0x504C5445: // PLTE
+            case 0x74524E53: // tRNS
+                if ((status = read_table(
+                    &starlight, chunk_type, chunk_data, chunk_length
+                ))) return status;
+
+                info->palette_count = starlight.png.palette_count;
+                info->has_trns |= chunk_type == 0x74524E53;
+            break;
+
+            case 0x6163544C: // acTL
+                if (chunk_length != 8) return STARLIGHT_S_CORRUPT_DATA;
+
+                info->frame_count = load_u32_be(chunk_data);
+                info->play_count = load_u32_be(chunk_data + 4);
+            break;
+        }
+
+        chunk += 12 + (uint64_t)chunk_length;
+    }
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+starlight_status_t starlight_png_load_header(Starlight *starlight) {
+    StarlightBuffer *input = &starlight->raw;
+
+    // 8 byte length and type + 13 byte ihdr + 4 byte crc
+    if (input->e - input->c < 25) return STARLIGHT_S_CORRUPT_DATA;
+
+    uint32_t chunk_length = u32_be(input);
+    uint32_t chunk_type = u32_be(input);
+
+    if (chunk_length != 13 || chunk_type != 0x49484452) {
         return STARLIGHT_S_CORRUPT_DATA;
     }
 
-    starlight->output.x = 0;
-    starlight->output.y = 0;
-    starlight->output.width = starlight->width;
-    starlight->output.height = starlight->height;
+    starlight_status_t status = read_ihdr(starlight, input);
+    if (status) return status;
 
-    starlight->out.l= (
-        (starlight->width * starlight->height * 4) + starlight->height
-    );
+    // 17 = 4 byte chunk type + 13 byte chunk data
+    STATS_START(starlight, crc_timer);
+    uint32_t ihdr_crc = starlight_calc_crc(input->c - 17, 17);
+    STATS_STOP(starlight, STARLIGHT_T_CRC, crc_timer, 17);
 
-    printf(
-        "bit depth: %d - color type: %d\n",
-        starlight->png.bit_depth, starlight->png.color_type
-    );
+    if (ihdr_crc != u32_be(input)) {
+        return STARLIGHT_S_CORRUPT_DATA;
+    }
 
-    starlight->cmp.l = 0;
     starlight->buffer_moved = false;
+    starlight->png.idat_count = 0;
+
+    // the idat list of the last image in the scratch is reused
+    StarlightScratch *scratch = starlight->scratch;
+    if (scratch != NULL && scratch->idat != NULL) {
+        starlight->png.idat = scratch->idat;
+        starlight->png.idat_capacity =
+            scratch->idat_length / sizeof(StarlightBuffer);
+    }
 
+    bool single_pass = starlight->options & STARLIGHT_O_SINGLE_PASS;
     uint8_t *cursor_position = input->c;
 
+    STATS_START(starlight, scan_timer);
     while (input->c < input->e - 8) {
         uint32_t chunk_length = u32_be(input);
+
+        // 4 byte chunk type + chunk data + 4 byte crc
+        if ((uint64_t)chunk_length + 8 > (uint64_t)(input->e - input->c))
+            return STARLIGHT_S_CORRUPT_DATA;
+
+        STATS_START(starlight, crc_timer);
         uint32_t crc = starlight_calc_crc(input->c, 4 + chunk_length);
+        STATS_STOP(starlight, STARLIGHT_T_CRC, crc_timer, 4 + chunk_length);
         uint32_t chunk_type = u32_be(input);
         input->c += chunk_length;
 
         if (chunk_type == 0x49444154) {
-            printf("cmp.l: %ld\n", starlight->cmp.l);
-            starlight->cmp.l += chunk_length;
+            if (single_pass) {
+                if ((status = add_idat(
+                    starlight, input->c - chunk_length, chunk_length
+                ))) return status;
+            }
+        } else if (
+            single_pass && !((chunk_type >> 29) & 1) &&
+            chunk_type != 0x49454E44 && chunk_type != 0x504C5445
+        ) {
+            // unknown critical chunk, IEND and PLTE are the known ones
+            return STARLIGHT_S_CORRUPT_DATA;
         }
 
         uint32_t chunk_crc = u32_be(input);
-        printf(
-            "chunk length: %u - chunk crc: %u - crc: %u\n"
-            "data left: \33[32m%ld\33[m\n",
-            chunk_length, chunk_crc, crc,
-            input->e - input->c
-        );
-
         if (crc != chunk_crc) {
             return STARLIGHT_S_CORRUPT_DATA;
         }
 
+        if ((status = read_table(
+            starlight, chunk_type, input->c - 4 - chunk_length, chunk_length
+        ))) return status;
+
         // if (chunk_type == 0x49454E44) break;
     }
-
+    STATS_STOP(
+        starlight, STARLIGHT_T_CHUNK_SCAN, scan_timer,
+        input->c - cursor_position
+    );
 
     input->c = cursor_position;
     starlight->loader = starlight_png_loader;
@@ -153,72 +512,60 @@ starlight_status_t starlight_png_load_header(Starlight *starlight) {
 }
 
 starlight_status_t starlight_png_loader(Starlight *starlight) {
-
-    clock_t st_all = clock();
-    printf("all start: \33[32m%ld\33[m\n", st_all);
-
     starlight_status_t status = STARLIGHT_S_SUCCESS;
     StarlightBuffer *input = &starlight->raw;
 
-    if (starlight->out.s == NULL)
+    bool row_output = starlight->row != NULL || starlight->rows != NULL;
+    if (starlight->out.s == NULL && !row_output)
         return STARLIGHT_S_OUTPUT_DATA_IS_NULL;
 
     starlight->out.c = starlight->out.s;
     starlight->out.e = starlight->out.s + starlight->out.l;
 
-    if (starlight->cmp.s == NULL)
-        return STARLIGHT_S_BUFFER_IS_NULL;
+    if (starlight->options & STARLIGHT_O_SINGLE_PASS) {
+        // the chunks were walked and checked by starlight_png_load_header
+        return decode(starlight);
+    }
 
-    starlight->cmp.c = starlight->cmp.s;
-    starlight->cmp.e = starlight->cmp.s + starlight->cmp.l;
+    bool decoded = false;
 
+    STATS_START(starlight, scan_timer);
     while (input->c < input->e - 8) {
         uint32_t chunk_length = u32_be(input);
         uint32_t chunk_type = u32_be(input);
 
         switch (chunk_type) {
             case 0x49444154: { // IDAT
-                memcpy(starlight->cmp.c, input->c, chunk_length);
-                starlight->cmp.c += chunk_length;
-                input->c += chunk_length;
-
-            } break;
+                if (decoded) {
+                    // idat chunks left over after the end of the stream
+                    input->c += chunk_length;
+                    break;
+                }
 
-            case 0x49454E44: { // IEND
-                clock_t st_inflate = clock();
-                printf("inflate start: \33[32m%ld\33[m\n", st_inflate);
-                status = starlight_inflate(&starlight->cmp, &starlight->out);
-                if (status)
+                // inflate pulls this and the following idat chunks in place
+                // and leaves the cursor on the chunk after the last one
+                input->c -= 8;
+                if ((status = decode(starlight)))
                     return status;
 
-                clock_t et_inflate = clock();
-                printf(
-                    "inflate took: \33[33m%ld\33[m\n",
-                    et_inflate - st_inflate
-                );
+                decoded = true;
+                continue;
+            }
 
-                clock_t st_recon = clock();
-                printf("reconstruct start: \33[32m%ld\33[m\n", st_recon);
-                if ((status = reconstruct(starlight)))
-                    return status;
+            case 0x504C5445: { // PLTE
+                // read by starlight_png_load_header
+                input->c += chunk_length;
+            } break;
 
-                clock_t et_recon = clock();
-                printf(
-                    "reconstruc took: \33[33m%ld\33[m\n",
-                    et_recon - st_recon
-                );
+            case 0x49454E44: { // IEND
+                if (!decoded)
+                    return STARLIGHT_S_CORRUPT_DATA;
 
                 // return STARLIGHT_S_SUCCESS;
             } break;
 
             default: {
-                uint8_t *cta = (uint8_t *)&chunk_type;
-                printf(
-                    "ignoring chunk type: 0x%X - %c%c%c%c\n",
-                    chunk_type, cta[3], cta[2], cta[1], cta[0]
-                );
-
-                if ((cta[3] >> 5) & 1) {
+                if ((chunk_type >> 29) & 1) {
                     // ignore the ancillary chunk and it CRC
                     input->c += chunk_length;
                 } else {
@@ -229,140 +576,1457 @@ starlight_status_t starlight_png_loader(Starlight *starlight) {
 
         input->c += 4;
     }
+    STATS_STOP(
+        starlight, STARLIGHT_T_CHUNK_SCAN, scan_timer, input->c - input->s
+    );
 
-    clock_t et_all = clock();
-
-    printf("all took: \33[33m%ld\33[m\n", et_all - st_all);
+    // the file ended before any image data, out was never written
+    if (!decoded) return STARLIGHT_S_CORRUPT_DATA;
 
     return STARLIGHT_S_SUCCESS;
 }
 
-static starlight_status_t reconstruct(Starlight *starlight) {
-
-    uint8_t *data = starlight->out.s;
+static starlight_status_t decode(Starlight *starlight) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
 
-    uint32_t x = 0;
-    uint32_t y = 0;
-    uint32_t w = starlight->width;
-    uint32_t h = starlight->height;
-    uint8_t bpp = starlight->png.bpp;
+    if (starlight->png.color_type == 3 && !starlight->png.palette_count)
+        return STARLIGHT_S_CORRUPT_DATA;
 
-    uint64_t i = 0;
-    uint64_t o = 0;
+    // interlaced rows land all over the image, and row output has no out
+    // to keep the tail in, so the tail trick is out for both
+    if (
+        !(starlight->options & STARLIGHT_O_TWO_PASS) ||
+        starlight->png.interlace_method ||
+        starlight->rows != NULL || starlight->row != NULL
+    ) return decode_rows(starlight);
 
-    uint8_t filter_type = data[0]; i++;
-    printf("first filter_type: %d\n", filter_type);
+    if (starlight->out.s == NULL)
+        return STARLIGHT_S_OUTPUT_DATA_IS_NULL;
 
-    if (filter_type == 0) {
-        for (; x < w * bpp; x++, o++, i++) data[o] = data[i];
-    } else if (filter_type == 1) {
-        for (; x < bpp; x++, o++, i++) data[o] = data[i];
-        for (; x < w * bpp; x++, o++, i++)
-            data[o] = data[i] + data[o - bpp];
-    } else if (filter_type == 2) {
-        for (; x < w * bpp; x++, o++, i++) data[o] = data[i];
-    } else if (filter_type == 3) {
-        for (; x < bpp; x++, i++, o++) data[o] = data[i];
-        for (; x < w * bpp; x++, i++, o++) {
-            uint8_t a = data[o - bpp];
-            data[o] = data[i] + (a >> 1);
-        }
-    } else if (filter_type == 4) {
-        for (; x < bpp; x++, i++, o++) data[o] = data[i];
-        for (; x < w * bpp; x++, i++, o++)
-            data[o] = data[i] + data[o - bpp];
+    /*
+     * the filtered scanlines go to the tail of out, so every row can be
+     * reconstructed straight to its final place at the front. out holds
+     * whichever of the two is larger, so the tail starts far enough in
+     * that the rows written never reach a scanline not read yet.
+     */
+    uint64_t filtered_length = (uint64_t)starlight->height * (
+        1 + scanline_bytes(starlight, starlight->width)
+    );
+    StarlightBuffer filtered = {
+        .s = starlight->out.e - filtered_length,
+        .c = starlight->out.e - filtered_length,
+        .e = starlight->out.e,
+        .l = filtered_length,
+    };
+
+    STATS_START(starlight, inflate_timer);
+    if (starlight->options & STARLIGHT_O_SINGLE_PASS) {
+        status = starlight_inflate_segments(
+            starlight->png.idat, starlight->png.idat_count,
+            &filtered, starlight->options
+        );
     } else {
-        return STARLIGHT_S_CORRUPT_DATA;
+        StarlightSource source = { .next = next_idat, .data = &starlight->raw };
+        status = starlight_inflate_source(
+            &source, &filtered, starlight->options
+        );
     }
 
-    for (y = 1; y < h; y++) {
-        filter_type = data[i]; i++;
-        x = 0;
-
-        if (filter_type == 0) {
-            for (; x < w * bpp; x++, i++, o++) data[o] = data[i];
-        } else if (filter_type == 1) {
-            for (; x < bpp; x++, i++, o++) data[o] = data[i];
-            for (; x < w * bpp; x++, i++, o++)
-                data[o] = data[i] + data[o - bpp];
-        } else if (filter_type == 2) {
-            for (; x < w * bpp; x++, i++, o++)
-                data[o] = data[i] + data[o - w * bpp];
-        } else if (filter_type == 3) {
-            for (; x < bpp; x++, i++, o++) {
-                uint8_t b = data[o - w * bpp];
-                data[o] = data[i] + (b >> 1);
-            }
-            for (; x < w * bpp; x++, i++, o++) {
-                uint8_t a = data[o - bpp];
-                uint8_t b = data[o - w * bpp];
-                data[o] = data[i] + ((a + b) >> 1);
-            }
-        } else if (filter_type == 4) {
-            for (; x < bpp; x++, i++, o++)
-                data[o] = data[i] + data[o - w * bpp];
+    if (status)
+        return status;
+    STATS_STOP(starlight, STARLIGHT_T_INFLATE, inflate_timer, 0);
 
-            for (; x < w * bpp; x++, i++, o++) {
-                uint8_t a = data[o - bpp];
-                uint8_t b = data[o - w * bpp];
-                uint8_t c = data[o - w * bpp - bpp];
+    return reconstruct(starlight, &filtered);
+}
 
-                int32_t  p = a + b - c;
+/*
+ * row output: the inflated stream is cut into scanlines, each one is
+ * unfiltered against the one before it as soon as it is complete and
+ * handed out in the pixel format, to starlight->rows[y] and / or the
+ * starlight->row callback, or else to its place in out. the filtered
+ * bytes are read straight from the inflate window while they are still
+ * in cache, and rows already in the output layout are unfiltered right
+ * into their destination. only rows that still need converting, or have
+ * nowhere to go, use the ring of two.
+ */
+typedef struct Scanlines {
+    Starlight *starlight;
+    uint64_t length; // filter byte + pixel bytes
+    uint64_t filled; // bytes of a scanline split between two flushes
+    uint8_t pass; // adam7 pass from 1 to 7, 0 for a plain image
+    uint32_t width; // of the rows in this pass
+    uint32_t height;
+    uint32_t y; // row in this pass
+    bool done; // every row of every pass is through
+    uint8_t *partial; // the split scanline, filtered
+    uint8_t *ring[2]; // unfiltered rows
+    uint8_t *zero; // the row above the first one of a pass
+    uint8_t *previous; // the last unfiltered row
+    uint8_t *pixels; // a converted row with nowhere else to go
+    uint8_t *rgba; // rgba8 on the way to another format
+    uint8_t *samples; // unpacked or narrowed samples
+    uint8_t *frame; // the whole image of an interlaced one
+    bool own_frame; // not out, the rows are handed out from it
+    bool free_frame; // not the scratch's either
+    uint8_t *block; // the buffers above up to samples, in one piece
+    bool own_block; // or else it belongs to starlight->scratch
+    uint32_t pixel_bits; // of the output
+    bool native; // unfiltered rows are already in the output layout
+} Scanlines;
+
+// adam7: the first column and row of each pass and the steps between
+static const uint8_t ADAM7[7][4] = {
+    { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+    { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 },
+};
+
+// the block each known pixel stands for once a pass is through
+static const uint8_t ADAM7_BLOCK[7][2] = {
+    { 8, 8 }, { 4, 8 }, { 4, 4 }, { 2, 4 }, { 2, 2 }, { 1, 2 }, { 1, 1 },
+};
+
+static bool output_is_native(Starlight *starlight) {
+    switch (starlight->pixel_format) {
+        case STARLIGHT_P_NATIVE:
+            return true;
+        case STARLIGHT_P_RGB8:
+            return (
+                starlight->png.color_type == 2 &&
+                starlight->png.bit_depth == 8
+            );
+        case STARLIGHT_P_RGBA8:
+            return (
+                starlight->png.color_type == 6 &&
+                starlight->png.bit_depth == 8
+            );
+        default:
+            return false;
+    }
+}
 
-                int32_t pa = starlight_abs(p - a);
-                int32_t pb = starlight_abs(p - b);
-                int32_t pc = starlight_abs(p - c);
+// set up the next pass with any pixels in it, or mark the image done
+static void next_pass(Scanlines *lines) {
+    Starlight *starlight = lines->starlight;
 
-                int32_t pr;
+    for (lines->pass++; lines->pass <= 7; lines->pass++) {
+        const uint8_t *p = ADAM7[lines->pass - 1];
+        lines->width = starlight->width > p[0] ?
+            (starlight->width - p[0] + p[2] - 1) / p[2] : 0;
+        lines->height = starlight->height > p[1] ?
+            (starlight->height - p[1] + p[3] - 1) / p[3] : 0;
 
-                if (pa <= pb && pa <= pc) {
-                    pr = a;
-                } else if (pb <= pc) {
-                    pr = b;
-                } else {
-                    pr = c;
-                }
+        if (lines->width && lines->height) break;
+    }
 
-                data[o] = data[i] + pr;
-            }
+    if (lines->pass > 7) {
+        lines->done = true;
+        return;
+    }
+
+    lines->length = 1 + scanline_bytes(starlight, lines->width);
+    lines->y = 0;
+    lines->previous = lines->zero;
+}
+
+#define SCANLINE_ALIGN 64
+
+static uint64_t align_up(uint64_t length) {
+    return (length + SCANLINE_ALIGN - 1) & ~(uint64_t)(SCANLINE_ALIGN - 1);
+}
+
+/*
+ * `length` bytes of a buffer kept in the scratch, grown when it is too
+ * small, or else allocated for this image alone.
+ */
+static uint8_t *take_scratch(
+    Starlight *starlight, uint8_t **memory, uint64_t *memory_length,
+    uint64_t length, bool *own
+) {
+    StarlightScratch *scratch = starlight->scratch;
+
+    *own = scratch == NULL;
+    if (scratch == NULL) return malloc(length);
+
+    uint8_t *grown = starlight_scratch_grow(
+        scratch, *memory, memory_length, length
+    );
+    if (grown != NULL) *memory = grown;
+    return grown;
+}
+
+static starlight_status_t begin_scanlines(
+    Scanlines *lines, Starlight *starlight
+) {
+    uint64_t length = 1 + scanline_bytes(starlight, starlight->width);
+
+    lines->starlight = starlight;
+    lines->length = length;
+    lines->filled = 0;
+    lines->pass = 0;
+    lines->width = starlight->width;
+    lines->height = starlight->height;
+    lines->y = 0;
+    lines->done = false;
+    lines->pixel_bits = output_bits(starlight);
+    lines->native = output_is_native(starlight);
+
+    // each buffer starts on a cache line of its own
+    uint64_t sizes[7] = {
+        length, length, length, length, starlight->output.stride,
+        (uint64_t)starlight->width * 4, (uint64_t)starlight->width * 4,
+    };
+    uint64_t block_length = 0;
+    for (uint32_t i = 0; i < 7; i++) block_length += align_up(sizes[i]);
+
+    StarlightScratch *scratch = starlight->scratch;
+    lines->block = take_scratch(
+        starlight, scratch ? &scratch->rows : NULL,
+        scratch ? &scratch->rows_length : NULL,
+        block_length, &lines->own_block
+    );
+    uint8_t *buffers[7] = { NULL };
+    uint64_t at = 0;
+    for (uint32_t i = 0; i < 7 && lines->block != NULL; i++) {
+        buffers[i] = lines->block + at;
+        at += align_up(sizes[i]);
+    }
+
+    lines->partial = buffers[0];
+    lines->ring[0] = buffers[1];
+    lines->ring[1] = buffers[2];
+    lines->zero = buffers[3];
+    lines->previous = lines->zero;
+    lines->pixels = buffers[4];
+    lines->rgba = buffers[5];
+    lines->samples = buffers[6];
+    if (lines->zero != NULL) memset(lines->zero, 0, length);
+
+    // interlaced images are put together in out, or else in a frame
+    // of their own that the rows are handed out from at the end
+    lines->frame = NULL;
+    lines->own_frame = false;
+    lines->free_frame = false;
+    if (starlight->png.interlace_method) {
+        if (starlight->rows == NULL && starlight->row == NULL) {
+            lines->frame = starlight->out.s;
         } else {
-            printf("unknown filter: %d, x: %d, y: %d\n", filter_type, x, y);
-            // printf("f: %d - %d - %d\n", *f, *(f + 1), *(f + 2));
-            return STARLIGHT_S_CORRUPT_DATA;
+            lines->frame = take_scratch(
+                starlight, scratch ? &scratch->frame : NULL,
+                scratch ? &scratch->frame_length : NULL,
+                starlight->output.stride * starlight->height,
+                &lines->free_frame
+            );
+            lines->own_frame = true;
         }
     }
 
-    if (bpp == 4) return STARLIGHT_S_SUCCESS;
+    if (
+        lines->block == NULL ||
+        (starlight->png.interlace_method && lines->frame == NULL)
+    ) return STARLIGHT_S_MALLOC_FAILED;
+
+    if (starlight->png.interlace_method) {
+        // keep the padding bits of packed rows clear
+        if (lines->pixel_bits < 8) memset(
+            lines->frame, 0, starlight->output.stride * starlight->height
+        );
+        next_pass(lines);
+    }
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+static void release_scanlines(Scanlines *lines) {
+    if (lines->own_block) free(lines->block);
+    if (lines->free_frame) free(lines->frame);
+    lines->block = NULL;
+    lines->own_block = false;
+    lines->partial = NULL;
+    lines->ring[0] = NULL;
+    lines->ring[1] = NULL;
+    lines->zero = NULL;
+    lines->pixels = NULL;
+    lines->rgba = NULL;
+    lines->samples = NULL;
+    lines->frame = NULL;
+}
 
-    clock_t st_reorder = clock();
+// an unfiltered 8 bit rgb or rgba row to the pixel format
+static void convert_rgb8(Scanlines *lines, uint8_t *dst, const uint8_t *src) {
+    Starlight *starlight = lines->starlight;
+    uint32_t width = lines->width;
+    bool alpha = starlight->png.color_type == 6;
 
-    uint8_t *temp = malloc(w * h * bpp);
+    switch (starlight->pixel_format) {
+        case STARLIGHT_P_RGB8:
+            starlight_strip_alpha8(dst, src, width);
+        break;
 
-    i = 0;
-    o = 0;
+        case STARLIGHT_P_BGRA8:
+            if (alpha) {
+                starlight_swap_rb8(dst, src, width);
+            } else {
+                starlight_expand_bgr8(dst, src, width);
+            }
+        break;
 
-    memcpy(temp, data, w * h * bpp);
+        case STARLIGHT_P_RGBA8_PREMULTIPLIED:
+            if (alpha) {
+                starlight_premultiply8(dst, src, width);
+            } else {
+                starlight_expand_rgb8(dst, src, width);
+            }
+        break;
 
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            data[o+0] = temp[i+0];
-            data[o+1] = temp[i+1];
-            data[o+2] = temp[i+2];
-            data[o+3] = 255;
+        case STARLIGHT_P_RGBA16:
+            if (!alpha) {
+                starlight_expand_rgb8(lines->rgba, src, width);
+                src = lines->rgba;
+            }
+            starlight_widen_8(dst, src, width * 4ull);
+        break;
 
-            i += 3;
-            o += 4;
-        }
+        default:
+            starlight_expand_rgb8(dst, src, width);
+        break;
     }
+}
 
-    free(temp);
+// pixels that match the tRNS color become transparent
+static void apply_trns(
+    Scanlines *lines, uint8_t *rgba, const uint8_t *src,
+    const uint8_t *samples
+) {
+    StarlightPngDetail *png = &lines->starlight->png;
+    uint32_t width = lines->width;
+    uint8_t channels = png->channels;
+
+    if (png->bit_depth == 16) {
+        for (uint32_t x = 0; x < width; x++, src += channels * 2) {
+            bool match = true;
+            for (uint8_t c = 0; c < channels; c++) {
+                match &= ((src[c * 2] << 8) | src[c * 2 + 1]) == png->trns[c];
+            }
+            if (match) rgba[x * 4 + 3] = 0;
+        }
+        return;
+    }
 
-    clock_t et_reorder = clock();
-    printf(
-        "reorder took: \33[33m%ld\33[m\n",
-        et_reorder - st_reorder
-    );
+    // the samples are bytes by now, and unpacked gray is scaled up
+    uint8_t mask = (1 << png->bit_depth) - 1;
+    uint8_t key[3];
+    for (uint8_t c = 0; c < channels; c++) {
+        key[c] = (png->trns[c] & mask) * (255 / mask);
+    }
 
-    return STARLIGHT_S_SUCCESS;
+    for (uint32_t x = 0; x < width; x++, samples += channels) {
+        bool match = true;
+        for (uint8_t c = 0; c < channels; c++) match &= samples[c] == key[c];
+        if (match) rgba[x * 4 + 3] = 0;
+    }
 }
 
+// any unfiltered row, except 16 bit ones headed for rgba16, to rgba8
+static void to_rgba8(Scanlines *lines, uint8_t *rgba, const uint8_t *src) {
+    StarlightPngDetail *png = &lines->starlight->png;
+    uint32_t width = lines->width;
+    uint64_t count = (uint64_t)width * png->channels;
+
+    if (png->bit_depth == 16 && png->color_type == 6) {
+        starlight_narrow_16(rgba, src, count);
+        return;
+    }
+
+    // 16 bit samples are narrowed and sub byte ones unpacked first
+    const uint8_t *samples = src;
+    if (png->bit_depth == 16) {
+        starlight_narrow_16(lines->samples, src, count);
+        samples = lines->samples;
+    } else if (png->bit_depth < 8) {
+        starlight_unpack_bits(
+            lines->samples, src, count, png->bit_depth, png->color_type == 0
+        );
+        samples = lines->samples;
+    }
+
+    switch (png->color_type) {
+        case 0:
+            starlight_expand_g8(rgba, samples, width);
+        break;
+
+        case 2:
+            starlight_expand_rgb8(rgba, samples, width);
+        break;
+
+        case 3:
+            starlight_expand_palette(rgba, samples, width, png->palette);
+        break;
+
+        case 4:
+            starlight_expand_ga8(rgba, samples, width);
+        break;
+
+        default:
+            memcpy(rgba, samples, count);
+        break;
+    }
+
+    if (png->has_trns) apply_trns(lines, rgba, src, samples);
+}
+
+// 16 bit rows keep their precision on the way to rgba16
+static void to_rgba16(Scanlines *lines, uint8_t *dst, const uint8_t *src) {
+    StarlightPngDetail *png = &lines->starlight->png;
+    uint32_t width = lines->width;
+    uint8_t channels = png->channels;
+
+    for (uint32_t x = 0; x < width; x++, src += channels * 2, dst += 8) {
+        uint16_t v[4];
+        for (uint8_t c = 0; c < channels; c++) {
+            v[c] = (src[c * 2] << 8) | src[c * 2 + 1];
+        }
+
+        bool transparent = png->has_trns;
+        for (uint8_t c = 0; c < channels && transparent; c++) {
+            transparent = v[c] == png->trns[c];
+        }
+
+        uint16_t pixel[4];
+        switch (png->color_type) {
+            case 0:
+                pixel[0] = pixel[1] = pixel[2] = v[0];
+                pixel[3] = transparent ? 0 : 0xFFFF;
+            break;
+
+            case 2:
+                memcpy(pixel, v, 6);
+                pixel[3] = transparent ? 0 : 0xFFFF;
+            break;
+
+            case 4:
+                pixel[0] = pixel[1] = pixel[2] = v[0];
+                pixel[3] = v[1];
+            break;
+
+            default:
+                memcpy(pixel, v, 8);
+            break;
+        }
+
+        memcpy(dst, pixel, 8);
+    }
+}
+
+/*
+ * rows not in the output layout yet go through rgba8, or straight to
+ * rgba16 when both ends have 16 bit samples. plain 8 bit rgb and rgba
+ * rows skip the detour.
+ */
+static void convert_row(Scanlines *lines, uint8_t *dst, const uint8_t *src) {
+    Starlight *starlight = lines->starlight;
+    StarlightPngDetail *png = &starlight->png;
+    starlight_pixel_format_t format = starlight->pixel_format;
+    uint32_t width = lines->width;
+
+    if (png->bit_depth == 16 && format == STARLIGHT_P_RGBA16) {
+        to_rgba16(lines, dst, src);
+        return;
+    }
+
+    if (png->bit_depth == 8 && (
+        png->color_type == 6 || (png->color_type == 2 && !png->has_trns)
+    )) {
+        convert_rgb8(lines, dst, src);
+        return;
+    }
+
+    uint8_t *rgba = format == STARLIGHT_P_RGBA8 ? dst : lines->rgba;
+    to_rgba8(lines, rgba, src);
+
+    switch (format) {
+        case STARLIGHT_P_RGB8:
+            starlight_strip_alpha8(dst, rgba, width);
+        break;
+
+        case STARLIGHT_P_BGRA8:
+            starlight_swap_rb8(dst, rgba, width);
+        break;
+
+        case STARLIGHT_P_RGBA8_PREMULTIPLIED:
+            starlight_premultiply8(dst, rgba, width);
+        break;
+
+        case STARLIGHT_P_RGBA16:
+            starlight_widen_8(dst, rgba, width * 4ull);
+        break;
+
+        default:
+        break;
+    }
+}
+
+// one sample of a packed row, for native output below 8 bits a pixel
+static uint8_t get_sample(const uint8_t *row, uint64_t x, uint8_t bits) {
+    uint8_t shift = 8 - bits - (x * bits) % 8;
+    return (row[x * bits / 8] >> shift) & ((1 << bits) - 1);
+}
+
+static void set_sample(uint8_t *row, uint64_t x, uint8_t bits, uint8_t v) {
+    uint8_t shift = 8 - bits - (x * bits) % 8;
+    uint8_t mask = ((1 << bits) - 1) << shift;
+    row[x * bits / 8] = (row[x * bits / 8] & ~mask) | (v << shift);
+}
+
+// copy a converted pass row to its place in the frame
+static void scatter_row(Scanlines *lines, const uint8_t *pixels) {
+    Starlight *starlight = lines->starlight;
+    const uint8_t *p = ADAM7[lines->pass - 1];
+    uint32_t bits = lines->pixel_bits;
+    uint8_t *dst = lines->frame +
+        ((uint64_t)p[1] + (uint64_t)lines->y * p[3]) *
+        starlight->output.stride;
+
+    if (bits < 8) {
+        for (uint32_t x = 0; x < lines->width; x++) set_sample(
+            dst, p[0] + (uint64_t)x * p[2], bits,
+            get_sample(pixels, x, bits)
+        );
+        return;
+    }
+
+    uint32_t size = bits / 8;
+    uint64_t step = (uint64_t)p[2] * size;
+    dst += p[0] * size;
+    if (size == 4) {
+        for (uint32_t x = 0; x < lines->width; x++, dst += step)
+            memcpy(dst, pixels + x * 4, 4);
+        return;
+    }
+    for (uint32_t x = 0; x < lines->width; x++, dst += step)
+        memcpy(dst, pixels + (uint64_t)x * size, size);
+}
+
+/*
+ * fill the pixels later passes have yet to decode: every known pixel is
+ * spread over the block it stands for, right then down
+ */
+static void replicate_pass(Scanlines *lines, uint8_t pass) {
+    Starlight *starlight = lines->starlight;
+    uint8_t bw = ADAM7_BLOCK[pass - 1][0];
+    uint8_t bh = ADAM7_BLOCK[pass - 1][1];
+    uint32_t bits = lines->pixel_bits;
+    uint64_t stride = starlight->output.stride;
+
+    for (uint32_t y = 0; y < starlight->height; y++) {
+        uint8_t *row = lines->frame + y * stride;
+        if (y % bh) {
+            memcpy(row, row - (uint64_t)(y % bh) * stride, stride);
+            continue;
+        }
+        if (bw == 1) continue;
+
+        for (uint32_t x = 0; x < starlight->width; x++) {
+            uint32_t from = x - x % bw;
+            if (from == x) continue;
+            if (bits < 8) {
+                set_sample(row, x, bits, get_sample(row, from, bits));
+            } else {
+                memcpy(
+                    row + (uint64_t)x * (bits / 8),
+                    row + (uint64_t)from * (bits / 8), bits / 8
+                );
+            }
+        }
+    }
+}
+
+/*
+ * a pass is through: move on to the next one and show the preview of
+ * this pass and of the empty ones skipped on the way
+ */
+static starlight_status_t finish_pass(Scanlines *lines) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    Starlight *starlight = lines->starlight;
+
+    uint8_t pass = lines->pass;
+    next_pass(lines);
+
+    for (; starlight->pass != NULL && pass < lines->pass; pass++) {
+        if (pass < 7) replicate_pass(lines, pass);
+        if ((status = starlight->pass(starlight, pass, lines->frame)))
+            return status;
+    }
+
+    if (!lines->done || !lines->own_frame) return STARLIGHT_S_SUCCESS;
+
+    // the frame is whole, hand it out row by row
+    for (uint32_t y = 0; y < starlight->height; y++) {
+        const uint8_t *row = lines->frame + y * starlight->output.stride;
+        if (starlight->rows != NULL)
+            memcpy(starlight->rows[y], row, starlight->output.stride);
+        if (
+            starlight->row != NULL &&
+            (status = starlight->row(starlight, y, row))
+        ) return status;
+    }
+    return STARLIGHT_S_SUCCESS;
+}
+
+// `filtered` against the previous row, into `row`
+static starlight_status_t unfilter_scanline(
+    Scanlines *lines, uint8_t *row, const uint8_t *filtered
+) {
+    STATS_START(lines->starlight, timer);
+    starlight_status_t status = starlight_unfilter_row(
+        filtered[0], row, filtered + 1, lines->previous,
+        lines->length - 1, lines->starlight->png.bpp
+    );
+    STATS_STOP(
+        lines->starlight, STARLIGHT_T_UNFILTER, timer, lines->length - 1
+    );
+    return status;
+}
+
+// a row of an adam7 pass, `filtered` as in finish_row
+static starlight_status_t finish_pass_row(
+    Scanlines *lines, const uint8_t *filtered
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    uint8_t *row = lines->previous == lines->ring[0] ?
+        lines->ring[1] : lines->ring[0];
+    if ((status = unfilter_scanline(lines, row, filtered)))
+        return status;
+
+    STATS_START(lines->starlight, timer);
+    const uint8_t *pixels = row;
+    if (!lines->native) {
+        convert_row(lines, lines->pixels, row);
+        pixels = lines->pixels;
+    }
+    scatter_row(lines, pixels);
+    STATS_STOP(
+        lines->starlight, STARLIGHT_T_EXPAND, timer,
+        ((uint64_t)lines->width * lines->pixel_bits + 7) / 8
+    );
+
+    lines->previous = row;
+    if (++lines->y == lines->height) return finish_pass(lines);
+    return STARLIGHT_S_SUCCESS;
+}
+
+// `filtered` is a whole scanline, filter byte first
+static starlight_status_t finish_row(
+    Scanlines *lines, const uint8_t *filtered
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    Starlight *starlight = lines->starlight;
+
+    if (lines->pass) return finish_pass_row(lines, filtered);
+
+    uint8_t *target = NULL;
+    if (starlight->rows != NULL) {
+        target = starlight->rows[lines->y];
+    } else if (starlight->row == NULL) {
+        target = starlight->out.s + lines->y * starlight->output.stride;
+    }
+
+    uint8_t *row = lines->previous == lines->ring[0] ?
+        lines->ring[1] : lines->ring[0];
+    if (lines->native && target != NULL) row = target;
+
+    if ((status = unfilter_scanline(lines, row, filtered)))
+        return status;
+
+    uint8_t *pixels = row;
+    if (!lines->native) {
+        STATS_START(starlight, timer);
+        pixels = target != NULL ? target : lines->pixels;
+        convert_row(lines, pixels, row);
+        STATS_STOP(
+            starlight, STARLIGHT_T_EXPAND, timer, starlight->output.stride
+        );
+    }
+
+    if (
+        starlight->row != NULL &&
+        (status = starlight->row(starlight, lines->y, pixels))
+    ) return status;
+
+    lines->previous = row;
+    if (++lines->y == lines->height) lines->done = true;
+    return STARLIGHT_S_SUCCESS;
+}
+
+// the inflate sink: cut the decompressed stream into scanlines
+static starlight_status_t take_scanlines(
+    void *user, const uint8_t *data, uint64_t length
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    Scanlines *lines = user;
+
+    // the inflated bytes are all counted here, whatever the path
+    STATS_BYTES(lines->starlight, STARLIGHT_T_INFLATE, length);
+    while (length) {
+        // more data than the image has rows for
+        if (lines->done) return STARLIGHT_S_CORRUPT_DATA;
+
+        // whole scanlines are read straight from the window
+        if (!lines->filled && length >= lines->length) {
+            // the length changes when a pass is through
+            uint64_t taken = lines->length;
+            if ((status = finish_row(lines, data)))
+                return status;
+
+            data += taken;
+            length -= taken;
+            continue;
+        }
+
+        uint64_t n = lines->length - lines->filled;
+        if (n > length) n = length;
+
+        memcpy(lines->partial + lines->filled, data, n);
+        lines->filled += n;
+        data += n;
+        length -= n;
+
+        if (lines->filled < lines->length) break;
+
+        lines->filled = 0;
+        if ((status = finish_row(lines, lines->partial)))
+            return status;
+    }
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+// the second pass: run the inflated image through the scanline ring
+static starlight_status_t reconstruct(
+    Starlight *starlight, const StarlightBuffer *filtered
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    if (filtered->c != filtered->e)
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    Scanlines lines;
+    if (!(status = begin_scanlines(&lines, starlight))) {
+        status = take_scanlines(&lines, filtered->s, filtered->l);
+    }
+
+    release_scanlines(&lines);
+    return status;
+}
+
+// inflate the idat chunks through the scanline ring
+static starlight_status_t decode_rows(Starlight *starlight) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    StarlightInflateStream *inflate = NULL;
+
+    Scanlines lines;
+    if ((status = begin_scanlines(&lines, starlight))) {
+        release_scanlines(&lines);
+        return status;
+    }
+
+    // a scratch keeps its inflate stream from one image to the next
+    StarlightScratch *scratch = starlight->scratch;
+    if (scratch != NULL) {
+        if (scratch->inflate == NULL) {
+            scratch->inflate = starlight_scratch_alloc(
+                scratch, starlight_inflate_stream_size()
+            );
+        }
+
+        inflate = scratch->inflate;
+        status = inflate == NULL ? STARLIGHT_S_MALLOC_FAILED :
+            starlight_inflate_reset(
+                inflate, take_scanlines, &lines, starlight->options
+            );
+    } else {
+        status = starlight_inflate_begin(
+            &inflate, take_scanlines, &lines, starlight->options
+        );
+    }
+
+    if (status) {
+        release_scanlines(&lines);
+        return status;
+    }
+
+    STATS_START(starlight, inflate_timer);
+
+    if (starlight->options & STARLIGHT_O_SINGLE_PASS) {
+        StarlightBuffer *idat = starlight->png.idat;
+        for (uint32_t i = 0; i < starlight->png.idat_count && !status; i++) {
+            status = starlight_inflate_feed(inflate, idat[i].s, idat[i].l);
+        }
+    } else {
+        StarlightSource source = { .next = next_idat, .data = &starlight->raw };
+        StarlightBuffer span;
+        while (!status && source.next(&source, &span)) {
+            status = starlight_inflate_feed(inflate, span.s, span.l);
+        }
+    }
+
+    starlight_status_t end_status = scratch != NULL ?
+        starlight_inflate_finish(inflate) : starlight_inflate_end(inflate);
+    if (!status) status = end_status;
+    STATS_STOP(starlight, STARLIGHT_T_INFLATE, inflate_timer, 0);
+
+    if (!status && !lines.done)
+        status = STARLIGHT_S_CORRUPT_DATA;
+
+    release_scanlines(&lines);
+    return status;
+}
+
+
+/*
+ * push decoding. the chunks are parsed as their bytes arrive, idat data
+ * goes straight into a push inflate, and each scanline it completes is
+ * unfiltered and handed out like in decode_rows. besides the inflate
+ * window only two scanlines are kept.
+ */
+typedef enum {
+    STREAM_SIGNATURE,
+    STREAM_CHUNK_HEADER,
+    STREAM_CHUNK_DATA,
+    STREAM_CHUNK_CRC,
+    STREAM_DONE,
+} stream_state_t;
+
+struct starlight_stream_t {
+    Starlight *starlight;
+    StarlightInflateStream *inflate;
+    starlight_status_t status;
+    stream_state_t state;
+
+    // the signature, a chunk header, ihdr data or a crc being collected
+    uint8_t field[13];
+    uint8_t have;
+
+    uint8_t table[768]; // PLTE or tRNS data
+
+    uint32_t chunk_length;
+    uint32_t chunk_type;
+    uint32_t chunk_left;
+    uint32_t crc; // computed over the chunk type and data
+    uint32_t chunk_crc; // stored after the chunk data
+
+    Scanlines lines;
+};
+
+starlight_status_t starlight_stream_begin(
+    Starlight *starlight, StarlightStream **stream
+) {
+    if (starlight->row == NULL && starlight->rows == NULL)
+        return STARLIGHT_S_OUTPUT_DATA_IS_NULL;
+
+    StarlightStream *s = calloc(1, sizeof(StarlightStream));
+    if (s == NULL) return STARLIGHT_S_MALLOC_FAILED;
+
+    s->starlight = starlight;
+    s->state = STREAM_SIGNATURE;
+
+    *stream = s;
+    return STARLIGHT_S_SUCCESS;
+}
+
+// collect a field of `size` bytes that may be split across feed calls
+static bool gather(
+    StarlightStream *s, const uint8_t **data, const uint8_t *end,
+    uint8_t size
+) {
+    uint64_t n = size - s->have;
+    if (n > (uint64_t)(end - *data)) n = end - *data;
+
+    memcpy(s->field + s->have, *data, n);
+    s->have += n;
+    *data += n;
+
+    if (s->have < size) return false;
+
+    s->have = 0;
+    return true;
+}
+
+static starlight_status_t start_image(StarlightStream *s) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    Starlight *starlight = s->starlight;
+
+    StarlightBuffer ihdr = {
+        .s = s->field, .c = s->field, .e = s->field + 13, .l = 13
+    };
+    if ((status = read_ihdr(starlight, &ihdr)))
+        return status;
+
+    if ((status = begin_scanlines(&s->lines, starlight)))
+        return status;
+
+    return starlight_inflate_begin(
+        &s->inflate, take_scanlines, &s->lines, starlight->options
+    );
+}
+
+static starlight_status_t end_chunk(StarlightStream *s) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    switch (s->chunk_type) {
+        case 0x49484452: // IHDR
+            return start_image(s);
+
+        case 0x504C5445: // PLTE
+        case 0x74524E53: // tRNS
+            return read_table(
+                s->starlight, s->chunk_type, s->table, s->chunk_length
+            );
+
+        case 0x49454E44: { // IEND
+            status = starlight_inflate_end(s->inflate);
+            s->inflate = NULL;
+            if (status) return status;
+
+            if (!s->lines.done)
+                return STARLIGHT_S_CORRUPT_DATA;
+
+            s->state = STREAM_DONE;
+        } break;
+    }
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+static starlight_status_t begin_chunk(StarlightStream *s) {
+    s->chunk_length = (
+        ((uint32_t)s->field[0] << 24) | (s->field[1] << 16) |
+        (s->field[2] << 8) | s->field[3]
+    );
+    s->chunk_type = (
+        ((uint32_t)s->field[4] << 24) | (s->field[5] << 16) |
+        (s->field[6] << 8) | s->field[7]
+    );
+    s->chunk_left = s->chunk_length;
+    s->crc = starlight_update_crc(0, s->field + 4, 4);
+
+    bool first = s->inflate == NULL;
+    uint32_t type = s->chunk_type;
+
+    // ihdr comes first and only once
+    if (first != (type == 0x49484452)) return STARLIGHT_S_CORRUPT_DATA;
+    if (first && s->chunk_length != 13) return STARLIGHT_S_CORRUPT_DATA;
+
+    bool table = type == 0x504C5445 || type == 0x74524E53; // PLTE, tRNS
+    if (table && s->chunk_length > sizeof(s->table))
+        return STARLIGHT_S_CORRUPT_DATA;
+
+    // a palette image cannot be decoded before its palette
+    Starlight *starlight = s->starlight;
+    if (
+        type == 0x49444154 && starlight->png.color_type == 3 &&
+        !starlight->png.palette_count
+    ) return STARLIGHT_S_CORRUPT_DATA;
+
+    // unknown critical chunk, IEND and PLTE are the known ones
+    if (
+        !((type >> 29) & 1) && type != 0x49484452 && type != 0x49444154 &&
+        type != 0x49454E44 && type != 0x504C5445
+    ) return STARLIGHT_S_CORRUPT_DATA;
+
+    s->state = s->chunk_length ? STREAM_CHUNK_DATA : STREAM_CHUNK_CRC;
+    return STARLIGHT_S_SUCCESS;
+}
+
+starlight_status_t starlight_stream_feed(
+    StarlightStream *s, const uint8_t *data, uint64_t length
+) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+    const uint8_t *end = data + length;
+
+    if (s->status)
+        return s->status;
+
+    while (data < end && !status) {
+        switch (s->state) {
+            case STREAM_SIGNATURE: {
+                if (!gather(s, &data, end, 8)) break;
+
+                if (memcmp(s->field, PNG_SIGNATURE, 8))
+                    status = STARLIGHT_S_UNKNOWN_FORMAT;
+
+                s->state = STREAM_CHUNK_HEADER;
+            } break;
+
+            case STREAM_CHUNK_HEADER: {
+                if (gather(s, &data, end, 8))
+                    status = begin_chunk(s);
+            } break;
+
+            case STREAM_CHUNK_DATA: {
+                uint64_t n = s->chunk_left;
+                if (n > (uint64_t)(end - data)) n = end - data;
+
+                STATS_START(s->starlight, crc_timer);
+                s->crc = starlight_update_crc(s->crc, data, n);
+                STATS_STOP(s->starlight, STARLIGHT_T_CRC, crc_timer, n);
+
+                if (s->chunk_type == 0x49444154) { // IDAT
+                    STATS_START(s->starlight, inflate_timer);
+                    status = starlight_inflate_feed(s->inflate, data, n);
+                    STATS_STOP(
+                        s->starlight, STARLIGHT_T_INFLATE, inflate_timer, 0
+                    );
+                } else if (s->chunk_type == 0x49484452) { // IHDR
+                    memcpy(s->field + 13 - s->chunk_left, data, n);
+                } else if (
+                    s->chunk_type == 0x504C5445 || // PLTE
+                    s->chunk_type == 0x74524E53 // tRNS
+                ) {
+                    uint32_t at = s->chunk_length - s->chunk_left;
+                    memcpy(s->table + at, data, n);
+                }
+
+                // ancillary chunks are skipped
+                data += n;
+                s->chunk_left -= n;
+                if (!s->chunk_left) s->state = STREAM_CHUNK_CRC;
+            } break;
+
+            case STREAM_CHUNK_CRC: {
+                // collected byte by byte, the ihdr data is still in field
+                for (; s->have < 4 && data < end; s->have++) {
+                    s->chunk_crc = (s->chunk_crc << 8) | *data++;
+                }
+
+                if (s->have < 4) break;
+
+                s->have = 0;
+                if (s->chunk_crc != s->crc) {
+                    status = STARLIGHT_S_CORRUPT_DATA;
+                    break;
+                }
+
+                s->state = STREAM_CHUNK_HEADER;
+                status = end_chunk(s);
+            } break;
+
+            case STREAM_DONE: {
+                // anything after IEND is ignored
+                data = end;
+            } break;
+        }
+    }
+
+    s->status = status;
+    return status;
+}
+
+// no more input: the image has to be complete. frees the stream
+starlight_status_t starlight_stream_end(StarlightStream *s) {
+    starlight_status_t status = s->status;
+
+    if (!status && s->state != STREAM_DONE)
+        status = STARLIGHT_S_CORRUPT_DATA;
+
+    if (s->inflate != NULL)
+        starlight_inflate_end(s->inflate);
+
+    release_scanlines(&s->lines);
+    free(s);
+    return status;
+}
+
+
+/*
+ * png encoding. the pixels in out, in the pixel format and with rows
+ * output.stride bytes apart (0 for rows right after each other), are
+ * filtered row by row and deflated into a png file in raw. raw is
+ * allocated here and belongs to the caller, to free(). native pixels
+ * are written as they are, with the color type, bit depth, palette and
+ * tRNS color from png. premultiplied pixels are not taken.
+ */
+#define IDAT_LENGTH (1u << 20) // most bytes of image data per chunk
+#define SAVE_BAND (1u << 20) // least filtered bytes in a band of rows
+
+static void store_u32_be(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+// a chunk at the cursor: length, type and data, the crc comes later
+static uint8_t *place_chunk(
+    StarlightBuffer *file, uint32_t type, const uint8_t *data, uint32_t length
+) {
+    uint8_t *chunk = file->c;
+    store_u32_be(chunk, length);
+    store_u32_be(chunk + 4, type);
+    if (length) memcpy(chunk + 8, data, length);
+    file->c += 12 + length;
+    return chunk;
+}
+
+static void seal_chunk(uint8_t *chunk) {
+    uint32_t length = load_u32_be(chunk);
+    uint32_t crc = starlight_calc_crc(chunk + 4, 4 + length);
+    store_u32_be(chunk + 8 + length, crc);
+}
+
+static void put_chunk(
+    StarlightBuffer *file, uint32_t type, const uint8_t *data, uint32_t length
+) {
+    seal_chunk(place_chunk(file, type, data, length));
+}
+
+// the png color type and bit depth the pixel format is written as
+static starlight_status_t save_layout(Starlight *starlight) {
+    StarlightPngDetail *png = &starlight->png;
+
+    switch (starlight->pixel_format) {
+        case STARLIGHT_P_RGBA8:
+        case STARLIGHT_P_BGRA8:
+            png->color_type = 6;
+            png->bit_depth = 8;
+        break;
+
+        case STARLIGHT_P_RGB8:
+            png->color_type = 2;
+            png->bit_depth = 8;
+        break;
+
+        case STARLIGHT_P_RGBA16:
+            png->color_type = 6;
+            png->bit_depth = 16;
+        break;
+
+        case STARLIGHT_P_NATIVE:
+            if (!valid_depth(png->color_type, png->bit_depth))
+                return STARLIGHT_S_NOT_IMPLEMENTED;
+            if (png->color_type == 3 && (
+                png->palette_count == 0 ||
+                png->palette_count > (1u << png->bit_depth)
+            )) return STARLIGHT_S_NOT_IMPLEMENTED;
+        break;
+
+        default:
+            return STARLIGHT_S_NOT_IMPLEMENTED;
+    }
+
+    png->compression_method = 0;
+    png->filter_method = 0;
+    png->interlace_method = 0;
+    set_pixel_size(starlight);
+    return STARLIGHT_S_SUCCESS;
+}
+
+// a row of pixels in the layout the file stores, if it differs
+static const uint8_t *save_row(
+    Starlight *starlight, uint8_t *line, const uint8_t *pixels
+) {
+    uint64_t width = starlight->width;
+
+    switch (starlight->pixel_format) {
+        case STARLIGHT_P_BGRA8:
+            starlight_swap_rb8(line, pixels, width);
+            return line;
+
+        // host byte order to big endian
+        case STARLIGHT_P_RGBA16:
+            for (uint64_t i = 0; i < width * 4; i++) {
+                uint16_t sample;
+                memcpy(&sample, pixels + i * 2, 2);
+                line[i * 2] = (uint8_t)(sample >> 8);
+                line[i * 2 + 1] = (uint8_t)sample;
+            }
+            return line;
+
+        default:
+            return pixels;
+    }
+}
+
+/*
+ * with threads the image is filtered and compressed in bands of rows,
+ * each band on whichever thread is free, and the idat crcs are worked
+ * out the same way. the rows come out filtered the same either way.
+ */
+typedef struct PngWriter {
+    Starlight *starlight;
+    uint64_t length; // bytes in a row, without the filter byte
+    uint64_t stride; // bytes between the rows of out
+    uint32_t band_rows;
+    uint32_t band_count;
+    uint8_t *zero; // the row above the first
+    StarlightBuffer filtered;
+    StarlightBuffer compressed;
+    uint8_t **idat; // the idat chunks in raw
+} PngWriter;
+
+// the scratch rows of a band being filtered
+typedef struct FilterRows {
+    uint8_t *line[2]; // rows of out in the layout the file stores
+    uint8_t *spare;
+    uint8_t *best;
+} FilterRows;
+
+static starlight_status_t begin_writer(
+    Starlight *starlight, PngWriter *writer
+) {
+    uint64_t length = scanline_bytes(starlight, starlight->width);
+    uint64_t stride = starlight->output.stride;
+    if (stride == 0)
+        stride = ((uint64_t)starlight->width * output_bits(starlight) + 7) / 8;
+
+    writer->starlight = starlight;
+    writer->length = length;
+    writer->stride = stride;
+    writer->zero = calloc(1, length);
+    writer->filtered.l = starlight->height * (1 + length);
+    writer->filtered.s = malloc(writer->filtered.l);
+    writer->compressed.l = starlight_deflate_bound(writer->filtered.l);
+    writer->compressed.s = malloc(writer->compressed.l);
+
+    /*
+     * a few bands per thread so the ones that compress slower do not
+     * hold the rest up, and no smaller than SAVE_BAND so the flush and
+     * the fresh hash table at each band do not add up
+     */
+    uint64_t band = writer->filtered.l;
+    if (starlight->threads > 1) {
+        band = band / ((uint64_t)starlight->threads * 4);
+        if (band < SAVE_BAND) band = SAVE_BAND;
+    }
+    uint64_t band_rows = (band + length) / (1 + length);
+    writer->band_rows = band_rows < starlight->height ?
+        (uint32_t)band_rows : starlight->height;
+    writer->band_count = (uint32_t)(
+        ((uint64_t)starlight->height + writer->band_rows - 1) /
+        writer->band_rows
+    );
+
+    if (
+        writer->zero == NULL || writer->filtered.s == NULL ||
+        writer->compressed.s == NULL
+    ) return STARLIGHT_S_MALLOC_FAILED;
+
+    return STARLIGHT_S_SUCCESS;
+}
+
+static void release_writer(PngWriter *writer) {
+    free(writer->zero);
+    free(writer->filtered.s);
+    free(writer->compressed.s);
+    free(writer->idat);
+}
+
+/*
+ * the filter for a row: none for palette and packed images, where the
+ * others rarely help, otherwise sub on the first row and up after it
+ * at the fastest level, and whichever of the five leaves the smallest
+ * sum of magnitudes at the balanced one.
+ */
+static void filter_scanline(
+    Starlight *starlight, PngWriter *writer, FilterRows *rows, uint8_t *dst,
+    const uint8_t *row, const uint8_t *prev, bool first
+) {
+    StarlightPngDetail *png = &starlight->png;
+    uint64_t length = writer->length;
+    uint8_t bpp = png->bpp;
+
+    if (png->color_type == 3 || png->bit_depth < 8) {
+        dst[0] = 0;
+        memcpy(dst + 1, row, length);
+        return;
+    }
+
+    if (starlight->level == STARLIGHT_L_FASTEST) {
+        dst[0] = first ? 1 : 2;
+        starlight_filter_row(dst[0], dst + 1, row, prev, length, bpp, NULL);
+        return;
+    }
+
+    uint8_t chosen = 0;
+    uint64_t smallest = UINT64_MAX;
+    for (uint8_t filter_type = 0; filter_type < 5; filter_type++) {
+        uint64_t cost = 0;
+        starlight_filter_row(
+            filter_type, rows->spare, row, prev, length, bpp, &cost
+        );
+        if (cost >= smallest) continue;
+
+        uint8_t *swap = rows->best;
+        rows->best = rows->spare;
+        rows->spare = swap;
+        smallest = cost;
+        chosen = filter_type;
+    }
+
+    dst[0] = chosen;
+    memcpy(dst + 1, rows->best, length);
+}
+
+static starlight_status_t filter_band(void *user, uint32_t band) {
+    PngWriter *writer = user;
+    Starlight *starlight = writer->starlight;
+    uint64_t length = writer->length;
+
+    uint32_t y = band * writer->band_rows;
+    uint32_t end = starlight->height - y > writer->band_rows ?
+        y + writer->band_rows : starlight->height;
+
+    uint8_t *scratch = malloc(length * 4);
+    if (scratch == NULL) return STARLIGHT_S_MALLOC_FAILED;
+    FilterRows rows = {
+        .line = { scratch, scratch + length },
+        .spare = scratch + length * 2,
+        .best = scratch + length * 3,
+    };
+
+    // the band starts off the last row of the one above
+    const uint8_t *prev = writer->zero;
+    if (y) prev = save_row(
+        starlight, rows.line[(y - 1) & 1],
+        starlight->out.s + (y - 1) * writer->stride
+    );
+
+    for (; y < end; y++) {
+        const uint8_t *row = save_row(
+            starlight, rows.line[y & 1], starlight->out.s + y * writer->stride
+        );
+        filter_scanline(
+            starlight, writer, &rows,
+            writer->filtered.s + y * (1 + length), row, prev, y == 0
+        );
+        prev = row;
+    }
+
+    free(scratch);
+    return STARLIGHT_S_SUCCESS;
+}
+
+static starlight_status_t seal_idat(void *user, uint32_t index) {
+    PngWriter *writer = user;
+    seal_chunk(writer->idat[index]);
+    return STARLIGHT_S_SUCCESS;
+}
+
+// the tRNS chunk data, with the palette alpha up to the last entry
+// that is not opaque, or the transparent gray or rgb color
+static uint32_t save_trns(Starlight *starlight, uint8_t *trns) {
+    StarlightPngDetail *png = &starlight->png;
+    uint32_t length = 0;
+
+    if (png->color_type == 3) {
+        for (uint32_t i = 0; i < png->palette_count; i++) {
+            trns[i] = png->palette[i * 4 + 3];
+            if (trns[i] != 255) length = i + 1;
+        }
+        return length;
+    }
+
+    if (starlight->pixel_format != STARLIGHT_P_NATIVE || !png->has_trns)
+        return 0;
+    if (png->color_type != 0 && png->color_type != 2) return 0;
+
+    for (uint8_t i = 0; i < png->channels; i++) {
+        trns[i * 2] = (uint8_t)(png->trns[i] >> 8);
+        trns[i * 2 + 1] = (uint8_t)png->trns[i];
+    }
+    return png->channels * 2;
+}
+
+static starlight_status_t write_file(Starlight *starlight, PngWriter *writer) {
+    StarlightPngDetail *png = &starlight->png;
+    const uint8_t *data = writer->compressed.s;
+    uint64_t data_length = writer->compressed.c - writer->compressed.s;
+    uint64_t idat_count = (data_length + IDAT_LENGTH - 1) / IDAT_LENGTH;
+
+    uint8_t trns[256];
+    uint32_t trns_length = save_trns(starlight, trns);
+    uint32_t plte_length = png->color_type == 3 ? png->palette_count * 3 : 0;
+
+    StarlightBuffer file = {
+        .l = 8 + 25 + (plte_length ? 12 + plte_length : 0) +
+            (trns_length ? 12 + trns_length : 0) +
+            12 * idat_count + data_length + 12,
+    };
+    file.s = malloc(file.l);
+    if (file.s == NULL) return STARLIGHT_S_MALLOC_FAILED;
+    file.c = file.s;
+    file.e = file.s + file.l;
+
+    memcpy(file.c, PNG_SIGNATURE, 8);
+    file.c += 8;
+
+    uint8_t ihdr[13];
+    store_u32_be(ihdr, starlight->width);
+    store_u32_be(ihdr + 4, starlight->height);
+    ihdr[8] = png->bit_depth;
+    ihdr[9] = png->color_type;
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // no interlacing
+    put_chunk(&file, 0x49484452, ihdr, 13); // IHDR
+
+    if (plte_length) {
+        uint8_t plte[768];
+        for (uint32_t i = 0; i < png->palette_count; i++) {
+            memcpy(plte + i * 3, png->palette + i * 4, 3);
+        }
+        put_chunk(&file, 0x504C5445, plte, plte_length); // PLTE
+    }
+
+    if (trns_length) put_chunk(&file, 0x74524E53, trns, trns_length); // tRNS
+
+    writer->idat = malloc(sizeof(uint8_t *) * idat_count);
+    if (writer->idat == NULL) {
+        free(file.s);
+        return STARLIGHT_S_MALLOC_FAILED;
+    }
+
+    for (uint64_t i = 0; i < idat_count; i++) {
+        uint64_t left = data_length - i * IDAT_LENGTH;
+        writer->idat[i] = place_chunk(
+            &file, 0x49444154, data + i * IDAT_LENGTH, // IDAT
+            left < IDAT_LENGTH ? left : IDAT_LENGTH
+        );
+    }
+    starlight_parallel(starlight->threads, idat_count, seal_idat, writer);
+
+    put_chunk(&file, 0x49454E44, NULL, 0); // IEND
+
+    file.c = file.s;
+    starlight->raw = file;
+    return STARLIGHT_S_SUCCESS;
+}
+
+starlight_status_t starlight_png_save(Starlight *starlight) {
+    starlight_status_t status = STARLIGHT_S_SUCCESS;
+
+    if (starlight->out.s == NULL) return STARLIGHT_S_BUFFER_IS_NULL;
+    if (starlight->width == 0 || starlight->height == 0)
+        return STARLIGHT_S_CORRUPT_DATA;
+    if (starlight->level >= STARLIGHT_L_LENGTH)
+        return STARLIGHT_S_NOT_IMPLEMENTED;
+
+    if ((status = save_layout(starlight))) return status;
+    starlight->format = STARLIGHT_F_PNG;
+
+    PngWriter writer = {0};
+    status = begin_writer(starlight, &writer);
+
+    if (!status) status = starlight_parallel(
+        starlight->threads, writer.band_count, filter_band, &writer
+    );
+    if (!status) status = starlight_deflate_bands(
+        &writer.filtered, &writer.compressed, starlight->level,
+        starlight->threads, writer.band_rows * (1 + writer.length),
+        !(starlight->options & STARLIGHT_O_INDEPENDENT_BANDS)
+    );
+    if (!status) status = write_file(starlight, &writer);
+
+    release_writer(&writer);
+    return status;
+}
@@ -1,6 +1,12 @@
 
 #include "starlight.h"
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 static const char *STARLIGHT_STATUS_STRING[STARLIGHT_S_LENGTH] = {
     [STARLIGHT_S_SUCCESS] = "success",
     [STARLIGHT_S_UNKNOWN_FORMAT] = "unknown image format",
@@ -9,6 +15,8 @@ static const char *STARLIGHT_STATUS_STRING[STARLIGHT_S_LENGTH] = {
     [STARLIGHT_S_BUFFER_IS_NULL] = "buffer is not allocated",
     [STARLIGHT_S_MALLOC_FAILED] = "malloc faild.",
     [STARLIGHT_S_NOT_IMPLEMENTED] = "not implemented",
+    [STARLIGHT_S_OUTPUT_TOO_SMALL] = "output buffer is too small",
+    [STARLIGHT_S_FILE_ERROR] = "file could not be read",
 };
 
 const char *starlight_status_string(starlight_status_t status) {
@@ -28,3 +36,147 @@ starlight_status_t starlight_load(Starlight *starlight) {
     return STARLIGHT_S_UNKNOWN_FORMAT;
 }
 
+starlight_status_t starlight_load_fd(Starlight *starlight, int fd) {
+    // the file of an earlier load is let go of, mapping and all
+    if (starlight->mapped.s != NULL) starlight_release(starlight);
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return STARLIGHT_S_FILE_ERROR;
+    if ((uint64_t)st.st_size > SIZE_MAX) return STARLIGHT_S_FILE_ERROR;
+    if (st.st_size == 0) return STARLIGHT_S_UNKNOWN_FORMAT;
+
+    uint8_t *map = mmap(
+        NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0
+    );
+    if (map == MAP_FAILED) return STARLIGHT_S_FILE_ERROR;
+
+    // the chunks are read front to back, once. hints only, so a kernel
+    // that does not take them is no reason to fail
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    starlight->mapped = (StarlightBuffer) {
+        .s = map, .c = map, .e = map + st.st_size, .l = st.st_size,
+    };
+    starlight->raw = starlight->mapped;
+
+    starlight_status_t status = starlight_load(starlight);
+    if (status) starlight_release(starlight);
+    return status;
+}
+
+starlight_status_t starlight_load_file(Starlight *starlight, const char *path) {
+    if (path == NULL) return STARLIGHT_S_BUFFER_IS_NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return STARLIGHT_S_FILE_ERROR;
+
+    // the mapping outlives the descriptor
+    starlight_status_t status = starlight_load_fd(starlight, fd);
+    close(fd);
+    return status;
+}
+
+// the header of an image, and no more than info->scan bytes after it
+starlight_status_t starlight_probe(
+    const uint8_t *data, uint64_t length, StarlightInfo *info
+) {
+    uint64_t scan = info->scan;
+    memset(info, 0, sizeof(*info));
+    info->scan = scan;
+
+    if (data == NULL) return STARLIGHT_S_BUFFER_IS_NULL;
+
+    return starlight_png_probe(data, length, info);
+}
+
+// free what starlight_load allocated, the caller owns raw and out
+// unless they were mapped by starlight_load_fd
+void starlight_release(Starlight *starlight) {
+    StarlightScratch *scratch = starlight->scratch;
+
+    if (starlight->mapped.s != NULL) {
+        if (starlight->raw.s == starlight->mapped.s)
+            memset(&starlight->raw, 0, sizeof(StarlightBuffer));
+        munmap(starlight->mapped.s, starlight->mapped.l);
+        memset(&starlight->mapped, 0, sizeof(StarlightBuffer));
+    }
+
+    // a scratch keeps its idat list for the next image
+    if (scratch == NULL || starlight->png.idat != scratch->idat)
+        free(starlight->png.idat);
+    starlight->png.idat = NULL;
+    starlight->png.idat_count = 0;
+    starlight->png.idat_capacity = 0;
+}
+
+void *starlight_scratch_alloc(StarlightScratch *scratch, uint64_t size) {
+    StarlightAllocator *allocator = &scratch->allocator;
+    if (allocator->alloc == NULL) return malloc(size);
+    return allocator->alloc(allocator->user, size);
+}
+
+void starlight_scratch_free(StarlightScratch *scratch, void *memory) {
+    StarlightAllocator *allocator = &scratch->allocator;
+    if (memory == NULL) return;
+    if (allocator->alloc == NULL) free(memory);
+    else if (allocator->free != NULL) allocator->free(allocator->user, memory);
+}
+
+void *starlight_scratch_grow(
+    StarlightScratch *scratch, void *memory, uint64_t *length,
+    uint64_t needed
+) {
+    if (memory != NULL && *length >= needed) return memory;
+
+    void *grown = starlight_scratch_alloc(scratch, needed);
+    if (grown == NULL) return NULL;
+
+    if (memory != NULL) memcpy(grown, memory, *length);
+    starlight_scratch_free(scratch, memory);
+    *length = needed;
+    return grown;
+}
+
+void starlight_scratch_release(StarlightScratch *scratch) {
+    starlight_scratch_free(scratch, scratch->rows);
+    starlight_scratch_free(scratch, scratch->frame);
+    starlight_scratch_free(scratch, scratch->idat);
+    starlight_scratch_free(scratch, scratch->out);
+    starlight_scratch_free(scratch, scratch->inflate);
+
+    StarlightAllocator allocator = scratch->allocator;
+    memset(scratch, 0, sizeof(StarlightScratch));
+    scratch->allocator = allocator;
+}
+
+starlight_status_t starlight_scratch_out(Starlight *starlight) {
+    StarlightScratch *scratch = starlight->scratch;
+    if (scratch == NULL) return STARLIGHT_S_BUFFER_IS_NULL;
+
+    uint8_t *out = starlight_scratch_grow(
+        scratch, scratch->out, &scratch->out_length, starlight->out.l
+    );
+    if (out == NULL) return STARLIGHT_S_MALLOC_FAILED;
+
+    scratch->out = out;
+    starlight->out.s = out;
+    return STARLIGHT_S_SUCCESS;
+}
+
+void *starlight_arena_alloc(void *arena, uint64_t size) {
+    StarlightBuffer *buffer = arena;
+
+    uint64_t skip = -(uintptr_t)buffer->c & 63;
+    if ((uint64_t)(buffer->e - buffer->c) < skip + size) return NULL;
+
+    uint8_t *memory = buffer->c + skip;
+    buffer->c = memory + size;
+    return memory;
+}
+
+void starlight_arena_free(void *arena, void *memory) {
+    (void)arena;
+    (void)memory;
+}
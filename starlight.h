@@ -7,8 +7,6 @@
 
 #include <string.h>
 
-#include <stdio.h> // printf only
-
 typedef enum {
     STARLIGHT_S_SUCCESS = 0,
     STARLIGHT_S_UNKNOWN_FORMAT,
@@ -17,6 +15,8 @@ typedef enum {
     STARLIGHT_S_BUFFER_IS_NULL,
     STARLIGHT_S_MALLOC_FAILED,
     STARLIGHT_S_NOT_IMPLEMENTED,
+    STARLIGHT_S_OUTPUT_TOO_SMALL,
+    STARLIGHT_S_FILE_ERROR,
     STARLIGHT_S_LENGTH,
 } starlight_status_t;
 
@@ -26,13 +26,149 @@ typedef enum {
     STARLIGHT_F_LENGTH,
 } starlight_image_format_t;
 
+typedef enum {
+    // trusted input, do not verify the zlib adler-32 checksum
+    STARLIGHT_O_SKIP_ADLER = 1 << 0,
+    // walk the chunks only once, in starlight_load, and keep a list of
+    // the idat chunks for the loader
+    STARLIGHT_O_SINGLE_PASS = 1 << 1,
+    // inflate the whole image into out, then reconstruct it in a second
+    // pass, instead of reconstructing each scanline as it is inflated.
+    // interlaced images and row output are decoded row by row as usual
+    STARLIGHT_O_TWO_PASS = 1 << 2,
+    // starlight_png_save with threads: compress each band of rows with
+    // an empty window rather than one primed from the band above, for
+    // bands that inflate on their own, at some cost in size
+    STARLIGHT_O_INDEPENDENT_BANDS = 1 << 3,
+} starlight_option_t;
+
+// deflate compression, trading output size for speed
+typedef enum {
+    // lazy matching over hash chains
+    STARLIGHT_L_BALANCED = 0,
+    // the first match a hash table lookup finds
+    STARLIGHT_L_FASTEST,
+    STARLIGHT_L_LENGTH,
+} starlight_level_t;
+
+/*
+ * the layout of the decoded pixels, chosen before starlight_load so the
+ * output size can be worked out. the default is rgba8.
+ */
+typedef enum {
+    STARLIGHT_P_RGBA8 = 0,
+    // unfiltered, as the file stores it: no conversion at all
+    STARLIGHT_P_NATIVE,
+    // alpha is dropped, not blended
+    STARLIGHT_P_RGB8,
+    STARLIGHT_P_BGRA8,
+    // rgba8 with the colors multiplied by alpha
+    STARLIGHT_P_RGBA8_PREMULTIPLIED,
+    // rgba, 16 bit samples in host byte order
+    STARLIGHT_P_RGBA16,
+    STARLIGHT_P_LENGTH,
+} starlight_pixel_format_t;
+
+/*
+ * decode stages, for the counters and timers in StarlightStats. they
+ * never overlap: a stage run inside another one, like the unfiltering
+ * done in the inflate sink, only counts towards itself.
+ */
+typedef enum {
+    // walking the chunks of a file loaded whole
+    STARLIGHT_T_CHUNK_SCAN = 0,
+    STARLIGHT_T_CRC,
+    STARLIGHT_T_INFLATE,
+    STARLIGHT_T_UNFILTER,
+    // rows to the pixel format, and into place for interlaced images
+    STARLIGHT_T_EXPAND,
+    STARLIGHT_T_LENGTH,
+} starlight_stage_t;
+
+/*
+ * added to by starlight_load, the loader and the push decoder when the
+ * library is built with STARLIGHT_STATS defined, left alone otherwise.
+ * bytes are what the stage went through: the chunks walked, the bytes
+ * checksummed, the bytes inflated, the scanline bytes unfiltered and the
+ * output bytes written.
+ */
+typedef struct starlight_stats_t {
+    uint64_t count[STARLIGHT_T_LENGTH]; // times the stage ran
+    uint64_t ns[STARLIGHT_T_LENGTH]; // monotonic clock
+    uint64_t bytes[STARLIGHT_T_LENGTH];
+} StarlightStats;
+
 typedef struct starlight_output_t {
     uint32_t width;
     uint32_t height;
     uint32_t x;
     uint32_t y;
+    uint64_t stride; // bytes per output row
 } StarlightOutput;
 
+typedef struct starlight_buffer_t {
+    uint8_t *s; // start
+    uint8_t *c; // cursor
+    uint8_t *e; // end
+    uint64_t l; // length
+} StarlightBuffer;
+
+/*
+ * input that arrives in several spans. next() hands out the next span
+ * (only s and l are used) and returns false once the input is exhausted.
+ * the spans are read in place and must stay valid during the call.
+ */
+typedef struct starlight_source_t {
+    bool (*next)(struct starlight_source_t *source, StarlightBuffer *span);
+    void *data;
+} StarlightSource;
+
+/*
+ * receives the output of a push inflate as it is decoded. the data is
+ * only valid during the call. a status other than success stops the
+ * stream and is handed back to the caller.
+ */
+typedef starlight_status_t (*StarlightSink)(
+    void *user, const uint8_t *data, uint64_t length
+);
+
+typedef struct starlight_inflate_stream_t StarlightInflateStream;
+
+/*
+ * where a scratch gets its memory. alloc returns memory aligned like
+ * malloc's, or NULL when there is none left. free is handed what alloc
+ * returned and may do nothing.
+ */
+typedef struct starlight_allocator_t {
+    void *(*alloc)(void *user, uint64_t size);
+    void (*free)(void *user, void *memory);
+    void *user;
+} StarlightAllocator;
+
+/*
+ * a decoder context: memory a decode leaves for the next one instead of
+ * freeing it. the scanline buffers, the frame of an interlaced image
+ * with row output, the idat list of a single pass load and the pixels
+ * of starlight_scratch_out grow to the largest image so far, the push
+ * inflate with its window and tables is kept as it is. once the images
+ * stop growing a decode allocates nothing. for one decode at a time,
+ * set in Starlight.scratch, and freed by starlight_scratch_release.
+ * the memory comes from `allocator`, malloc and free when it is unset.
+ */
+typedef struct starlight_scratch_t {
+    StarlightAllocator allocator;
+
+    uint8_t *rows;
+    uint64_t rows_length;
+    uint8_t *frame;
+    uint64_t frame_length;
+    struct starlight_buffer_t *idat;
+    uint64_t idat_length; // bytes
+    uint8_t *out;
+    uint64_t out_length;
+    StarlightInflateStream *inflate;
+} StarlightScratch;
+
 typedef struct starlight_png_detail_t {
     uint8_t bit_depth;
     uint8_t color_type;
@@ -45,27 +181,42 @@ typedef struct starlight_png_detail_t {
     uint8_t z_comp_info;
     uint32_t z_win_size;
     uint8_t z_comp_level;
-    uint8_t bpp; // byte per pixel
+    uint8_t bpp; // byte per pixel, at least 1 for the filters
+    uint8_t channels; // samples per pixel
+
+    // PLTE entries as rgba with the alpha from tRNS, the unused ones are
+    // opaque black
+    uint8_t palette[256 * 4];
+    uint16_t palette_count;
+
+    // the tRNS color of gray and rgb images, samples as stored
+    bool has_trns;
+    uint16_t trns[3];
+
+    // idat chunk payloads inside raw, filled by a single pass load
+    StarlightBuffer *idat;
+    uint32_t idat_count;
+    uint32_t idat_capacity;
 
     // state variables
     uint64_t sx;
     uint64_t sy;
 } StarlightPngDetail;
 
-typedef struct starlight_buffer_t {
-    uint8_t bdx; // bit index
-    uint8_t *s; // start
-    uint8_t *c; // cursor
-    uint8_t *e; // end
-    uint64_t l; // length
-} StarlightBuffer;
-
 typedef struct starlight_t {
     StarlightBuffer raw; // raw image data - full file input
-    StarlightBuffer cmp; // raw compressed data
-    StarlightBuffer out; // output pixels in RGBA
+    StarlightBuffer out; // output pixels, unless rows or row is set
+    // the file mapped by starlight_load_fd, raw points into it until
+    // starlight_release unmaps it
+    StarlightBuffer mapped;
 
     bool buffer_moved;
+    uint32_t options; // starlight_option_t flags
+    starlight_pixel_format_t pixel_format;
+    starlight_level_t level; // for starlight_png_save
+    // starlight_png_save encodes bands of rows on this many threads,
+    // 0 and 1 keep to the calling one
+    uint32_t threads;
 
     starlight_image_format_t format;
     StarlightPngDetail png;
@@ -76,27 +227,269 @@ typedef struct starlight_t {
     StarlightOutput output;
 
     starlight_status_t (*loader)(struct starlight_t *starlight);
+
+    /*
+     * row output, instead of `out`: every finished row of pixels is
+     * copied to rows[y] when the caller supplies a row pointer table,
+     * and handed to the row callback when it is set. the push decoder
+     * always works this way.
+     */
+    uint8_t **rows;
+    starlight_status_t (*row)(
+        struct starlight_t *starlight, uint32_t y, const uint8_t *pixels
+    );
+    /*
+     * adam7 images only: called with the whole image after each of the
+     * 7 passes, pass 1 to 7, even those small images leave empty. the
+     * pixels not decoded yet are filled in from the nearest decoded one
+     * above and to the left, so every pass is a coarser preview of the
+     * final image. the image is laid out as in `out`, and only valid
+     * during the call.
+     */
+    starlight_status_t (*pass)(
+        struct starlight_t *starlight, uint8_t pass, const uint8_t *image
+    );
+    void *user; // free for the row and pass callbacks
+
+    StarlightStats *stats; // optional, see StarlightStats
+    StarlightScratch *scratch; // optional, see StarlightScratch
 } Starlight;
 
+/*
+ * what starlight_probe finds out without decoding. `scan` is set by the
+ * caller: how many bytes past the IHDR chunk to look through for PLTE,
+ * tRNS and acTL, 0 for the header alone. the scan ends early at the
+ * image data, which those chunks have to come before.
+ */
+typedef struct starlight_info_t {
+    uint64_t scan;
+
+    starlight_image_format_t format;
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t interlace_method;
+    uint8_t channels; // samples per pixel
+
+    uint16_t palette_count; // PLTE entries, 0 without one
+    bool has_trns;
+    // from acTL, frame_count is 0 for a still image
+    uint32_t frame_count;
+    uint32_t play_count; // 0 loops forever
+} StarlightInfo;
+
+/*
+ * push decoder, fed the file bytes in pieces of any size as they arrive.
+ * width, height and png are filled in once the IHDR chunk is through.
+ */
+typedef struct starlight_stream_t StarlightStream;
+
+/*
+ * many images decoded at once by starlight_batch_decode. each image is
+ * set up as for starlight_load: raw, options, the pixel format and any
+ * output. an image without out or row output gets an out allocated for
+ * it. with a done callback that out is freed once done returns (done
+ * can keep it by taking out.s and setting it to NULL), and in_flight
+ * bounds how many of them are held at once. without one the outs are
+ * left to the caller. images are through in no set order, and several
+ * at a time, so the stats of each need a StarlightStats of their own.
+ */
+typedef struct starlight_batch_t {
+    Starlight *images;
+    uint32_t count;
+    starlight_status_t *status; // count entries, one set per image
+
+    uint32_t threads; // 0 for one per cpu
+    uint32_t in_flight; // 0 for no bound but the thread count
+
+    // called on a worker thread for each image, failed ones too
+    void (*done)(struct starlight_batch_t *batch, uint32_t index);
+    void *user; // free for the done callback
+} StarlightBatch;
+
+// one of `count` jobs handed to starlight_parallel, by index
+typedef starlight_status_t (*StarlightJob)(void *user, uint32_t index);
+
 
 /* common { */
-uint32_t starlight_calc_crc(uint8_t *buffer, uint64_t length);
+uint32_t starlight_calc_crc(const uint8_t *buffer, uint64_t length);
+uint32_t starlight_update_crc(
+    uint32_t crc, const uint8_t *buffer, uint64_t length
+);
+uint32_t starlight_calc_adler(const uint8_t *buffer, uint64_t length);
+uint32_t starlight_update_adler(
+    uint32_t adler, const uint8_t *buffer, uint64_t length
+);
+// the adler-32 of two buffers one after the other, length2 is the second's
+uint32_t starlight_combine_adler(
+    uint32_t adler1, uint32_t adler2, uint64_t length2
+);
+
+// deflate code tables shared by inflate and deflate, see common.c
+extern const uint16_t STARLIGHT_LENGTH_BASE[29];
+extern const uint8_t STARLIGHT_LENGTH_EXTRA[29];
+extern const uint16_t STARLIGHT_DIST_BASE[30];
+extern const uint8_t STARLIGHT_DIST_EXTRA[30];
+extern const uint8_t STARLIGHT_CL_ORDER[19];
+extern const uint8_t STARLIGHT_FIXED_LITLEN_LENGTHS[288];
+extern const uint8_t STARLIGHT_FIXED_DIST_LENGTHS[32];
+// the low `length` bits of code in reverse, as huffman codes are stored
+uint16_t starlight_reverse_bits(uint16_t code, uint8_t length);
+
+/*
+ * runs job(user, 0) to job(user, count - 1) on up to `threads` threads,
+ * the calling one included, in no set order. no new jobs start once one
+ * fails, and the first failure is returned.
+ */
+starlight_status_t starlight_parallel(
+    uint32_t threads, uint32_t count, StarlightJob job, void *user
+);
+
+/*
+ * row conversions over `count` pixels: rgb8, gray8 and gray-alpha8 to
+ * rgba8, rgb8 and rgba8 to bgra8, rgba8 to rgb8 and to premultiplied
+ * rgba8. narrow and widen take `count` samples, big endian 16 bit to
+ * 8 bit and 8 bit to 16 bit (times 257, so the byte order is moot).
+ */
+void starlight_expand_rgb8(uint8_t *dst, const uint8_t *src, uint64_t count);
+void starlight_expand_g8(uint8_t *dst, const uint8_t *src, uint64_t count);
+void starlight_expand_ga8(uint8_t *dst, const uint8_t *src, uint64_t count);
+void starlight_narrow_16(uint8_t *dst, const uint8_t *src, uint64_t count);
+void starlight_expand_bgr8(uint8_t *dst, const uint8_t *src, uint64_t count);
+void starlight_swap_rb8(uint8_t *dst, const uint8_t *src, uint64_t count);
+void starlight_strip_alpha8(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+);
+void starlight_premultiply8(
+    uint8_t *dst, const uint8_t *src, uint64_t count
+);
+void starlight_widen_8(uint8_t *dst, const uint8_t *src, uint64_t count);
+// `count` palette indices to rgba8, through 256 rgba entries
+void starlight_expand_palette(
+    uint8_t *dst, const uint8_t *src, uint64_t count, const uint8_t *palette
+);
+// `count` 1, 2 or 4 bit samples to bytes, scaled to 0..255 if `scale`
+void starlight_unpack_bits(
+    uint8_t *dst, const uint8_t *src, uint64_t count, uint8_t depth,
+    bool scale
+);
 
 /* } */
 
 /* starlight { */
 starlight_status_t starlight_load(Starlight *starlight);
+/*
+ * starlight_load on a whole file, mapped read only in place of raw. the
+ * chunks are walked and inflated straight from the mapping, which lasts
+ * until starlight_release. the fd is not closed and may be right after.
+ * a load that fails leaves nothing mapped, and the mapping of an earlier
+ * load on the same Starlight is released first.
+ */
+starlight_status_t starlight_load_file(Starlight *starlight, const char *path);
+starlight_status_t starlight_load_fd(Starlight *starlight, int fd);
+starlight_status_t starlight_probe(
+    const uint8_t *data, uint64_t length, StarlightInfo *info
+);
+void starlight_release(Starlight *starlight);
+void starlight_scratch_release(StarlightScratch *scratch);
+// after starlight_load: out in the scratch, valid until its next decode
+starlight_status_t starlight_scratch_out(Starlight *starlight);
+void *starlight_scratch_alloc(StarlightScratch *scratch, uint64_t size);
+void starlight_scratch_free(StarlightScratch *scratch, void *memory);
+/*
+ * `memory` of *length bytes, or a larger copy of it with its old one
+ * freed, at least `needed` bytes long. NULL when the memory runs out,
+ * with `memory` left as it was.
+ */
+void *starlight_scratch_grow(
+    StarlightScratch *scratch, void *memory, uint64_t *length,
+    uint64_t needed
+);
+/*
+ * a bump arena for StarlightAllocator, with a StarlightBuffer as `user`:
+ * alloc hands out the next 64 byte aligned piece from c up to e, free
+ * does nothing. putting c back at s frees everything at once.
+ */
+void *starlight_arena_alloc(void *arena, uint64_t size);
+void starlight_arena_free(void *arena, void *memory);
 const char *starlight_status_string(starlight_status_t status);
 /* } */
 
+/* batch { */
+// every image is decoded, the status is that of the first one to fail
+starlight_status_t starlight_batch_decode(StarlightBatch *batch);
+/* } */
+
 /* png { */
 starlight_status_t starlight_inflate(
     StarlightBuffer *input,
-    StarlightBuffer *output
+    StarlightBuffer *output,
+    uint32_t options
+);
+starlight_status_t starlight_inflate_source(
+    StarlightSource *source,
+    StarlightBuffer *output,
+    uint32_t options
+);
+starlight_status_t starlight_inflate_segments(
+    StarlightBuffer *segments, uint32_t count,
+    StarlightBuffer *output, uint32_t options
+);
+starlight_status_t starlight_inflate_begin(
+    StarlightInflateStream **stream,
+    StarlightSink sink, void *user, uint32_t options
+);
+starlight_status_t starlight_inflate_feed(
+    StarlightInflateStream *stream, const uint8_t *data, uint64_t length
+);
+starlight_status_t starlight_inflate_end(StarlightInflateStream *stream);
+// end a stream but keep it, to be started again with a reset
+starlight_status_t starlight_inflate_finish(StarlightInflateStream *stream);
+starlight_status_t starlight_inflate_reset(
+    StarlightInflateStream *stream,
+    StarlightSink sink, void *user, uint32_t options
+);
+// a reset also starts a stream in memory of this size, never used yet
+uint64_t starlight_inflate_stream_size(void);
+uint64_t starlight_deflate_bound(uint64_t length);
+starlight_status_t starlight_deflate(
+    StarlightBuffer *input, StarlightBuffer *output, starlight_level_t level
+);
+/*
+ * starlight_deflate on `threads` threads, the input cut into bands of
+ * `band` bytes (0 picks a size) that are compressed each on its own into
+ * one zlib stream. with `prime` every band can match into the 32 KiB
+ * before it, which keeps the output close to a single threaded one,
+ * without it the bands only refer to themselves. 1 thread, or input
+ * that makes a single band, gives the starlight_deflate stream.
+ */
+starlight_status_t starlight_deflate_bands(
+    StarlightBuffer *input, StarlightBuffer *output, starlight_level_t level,
+    uint32_t threads, uint64_t band, bool prime
+);
+starlight_status_t starlight_stream_begin(
+    Starlight *starlight, StarlightStream **stream
+);
+starlight_status_t starlight_stream_feed(
+    StarlightStream *stream, const uint8_t *data, uint64_t length
+);
+starlight_status_t starlight_stream_end(StarlightStream *stream);
+starlight_status_t starlight_unfilter_row(
+    uint8_t filter_type, uint8_t *dst, const uint8_t *src,
+    const uint8_t *prev, uint64_t length, uint8_t bpp
+);
+starlight_status_t starlight_filter_row(
+    uint8_t filter_type, uint8_t *dst, const uint8_t *src,
+    const uint8_t *prev, uint64_t length, uint8_t bpp, uint64_t *cost
 );
 bool starlight_png_check(Starlight *starlight);
+starlight_status_t starlight_png_probe(
+    const uint8_t *data, uint64_t length, StarlightInfo *info
+);
 starlight_status_t starlight_png_load_header(Starlight *starlight);
 starlight_status_t starlight_png_loader(Starlight *starlight);
+starlight_status_t starlight_png_save(Starlight *starlight);
 /* } */
 
 #endif // __LIB_STARLIGHT__